@@ -3,24 +3,108 @@
 #include <linux/init.h>
 #include <linux/slab.h>
 #include <linux/module.h>
+#include <linux/moduleparam.h>
 #include <linux/kref.h>
 #include <linux/usb.h>
+#include <linux/usb/cdc.h>
 #include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/semaphore.h>
+#include <linux/bitops.h>
+#include <linux/bitmap.h>
+#include <linux/hrtimer.h>
+#include <linux/workqueue.h>
+#include <linux/poll.h>
+#include <linux/atomic.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
 #include <linux/uaccess.h>
 
+#include "arduino_ioctl.h"
+
+#define CREATE_TRACE_POINTS
+#include "arduino_trace.h"
+
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Pablo Rodriguez Quesada");
 MODULE_DESCRIPTION("An Arduino Serial Module");
 MODULE_VERSION("0.01");
 
-#define BULK_EP_OUT 0x04   //address where arduino device allow write
-#define BULK_EP_IN 0x83	//address where arduino device allow read
-
-static DEFINE_MUTEX(fs_mutex); // Defining a mutex
-#define VENDOR_ID	0x2341
-#define PRODUCT_ID	0x0043
+#define VENDOR_ID	0x2341		// Arduino SA
+#define VENDOR_ID_ORG	0x2a03		// boards sold by arduino.org
 #define MINOR_BASE	192
-#define DEVICE_NAME "Arduino Uno R3"
+
+#define ARDUINO_READ_TIMEOUT	(HZ*10)		// default of how long read() waits for the board to send something
+#define ARDUINO_RX_RETRY	(HZ/10)		// how long a bulk in URB rests after a transfer error
+#define ARDUINO_LAT_BUCKETS	16		// log2 microsecond buckets of the URB latency histograms
+#define ARDUINO_RX_RECORDS	256		// completed bulk in transfers kept for record mode, a power of two
+#define ARDUINO_RX_FRAMES	1024		// frame boundaries kept for frame mode, a power of two
+#define ARDUINO_LINE_RATE	115200		// line coding set on boards with line_state, anything but the 1200 baud reset
+#define ARDUINO_CTRL_DTR	0x01		// SET_CONTROL_LINE_STATE bits
+#define ARDUINO_CTRL_RTS	0x02
+
+static unsigned int writes_in_flight;
+module_param(writes_in_flight, uint, 0444);
+MODULE_PARM_DESC(writes_in_flight, "Number of preallocated bulk out URBs, write() blocks once all are in flight (0: board default, at most 64)");
+
+/*
+ * I/O configuration of a board family, referenced by the driver_info of
+ * its id_table entries. Sizes are upper bounds, probe rounds the URB
+ * buffers down to whole packets of the endpoints it finds.
+ */
+struct arduino_board {
+	const char *	name;
+	unsigned int	rx_ring_pages;		// receive ring size in pages, a power of two
+	unsigned int	rx_urbs;		// bulk in URBs kept in flight
+	unsigned int	rx_urb_size;		// bytes per bulk in URB
+	unsigned int	tx_urbs;		// bulk out URBs in the write pool
+	unsigned int	tx_urb_size;		// bytes per bulk out URB, the largest single write
+	bool		line_state;		// sketch waits for DTR on the CDC comm interface, see device_comm_claim()
+};
+
+/* ATmega16U2 USB-serial bridge, the sketch's UART caps the rate at 115200 baud */
+static const struct arduino_board board_uno = {
+	.name		= "Arduino Uno",
+	.rx_ring_pages	= 4,
+	.rx_urbs	= 4,
+	.rx_urb_size	= 64,
+	.tx_urbs	= 8,
+	.tx_urb_size	= 512,
+};
+
+/* Same bridge as the Uno, but Mega sketches tend to stream from several sensors */
+static const struct arduino_board board_mega = {
+	.name		= "Arduino Mega 2560",
+	.rx_ring_pages	= 16,
+	.rx_urbs	= 8,
+	.rx_urb_size	= 64,
+	.tx_urbs	= 8,
+	.tx_urb_size	= 512,
+};
+
+/* ATmega32U4 with native USB, no UART in the way so every URB can carry several packets */
+static const struct arduino_board board_leonardo = {
+	.name		= "Arduino Leonardo",
+	.rx_ring_pages	= 16,
+	.rx_urbs	= 8,
+	.rx_urb_size	= 512,
+	.tx_urbs	= 16,
+	.tx_urb_size	= 2048,
+	.line_state	= true,
+};
+
+/* Only the CDC data interface carries the bulk endpoints we need, probe claims the comm interface where the board needs it */
+#define ARDUINO_DEVICE(vid, pid, board) \
+	{ USB_DEVICE_INTERFACE_CLASS(vid, pid, USB_CLASS_CDC_DATA), .driver_info = (kernel_ulong_t) &(board) }
+
+struct arduino;
+struct device_file;
 
 /* Prototypes for device functions */
 static void device_disconnect(struct usb_interface *interface);
@@ -30,31 +114,168 @@ static void device_delete(struct kref *kref );
 static int device_open(struct inode *inode, struct file *file );
 static int device_release(struct inode *inode, struct file *file );
 static ssize_t device_read(struct file *file, char __user *buffer, size_t count, loff_t *ppos);
+static void device_read_bulk_callback(struct urb *urb );
 static void device_write_bulk_callback(struct urb *urb );
 static ssize_t device_write(struct file *file, const char __user *user_buffer, size_t count, loff_t *ppos);
+static int device_flush(struct file *file, fl_owner_t id);
+static int device_fsync(struct file *file, loff_t start, loff_t end, int datasync);
+static long device_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
+static __poll_t device_poll(struct file *file, poll_table *wait);
+static int device_mmap(struct file *file, struct vm_area_struct *vma);
+static void device_draw_down(struct arduino *dev);
+static int device_coalesce_drain(struct arduino *dev, struct device_file *owner);
 
 /* Prototypes for device functions */
 
-/* table of devices that work with this driver */
-static struct usb_device_id id_table[] = {
-	{ USB_DEVICE(VENDOR_ID, PRODUCT_ID) },
+/*
+ * table of devices that work with this driver, application PIDs only: the
+ * bootloaders (Caterina's 0x0036 and friends) belong to cdc_acm, avrdude
+ * flashes through it
+ */
+static const struct usb_device_id id_table[] = {
+	ARDUINO_DEVICE(VENDOR_ID, 0x0001, board_uno),		// Uno
+	ARDUINO_DEVICE(VENDOR_ID, 0x0043, board_uno),		// Uno R3
+	ARDUINO_DEVICE(VENDOR_ID, 0x003d, board_uno),		// Due programming port
+	ARDUINO_DEVICE(VENDOR_ID_ORG, 0x0043, board_uno),	// Uno R3 (arduino.org)
+	ARDUINO_DEVICE(VENDOR_ID, 0x0010, board_mega),		// Mega 2560
+	ARDUINO_DEVICE(VENDOR_ID, 0x0042, board_mega),		// Mega 2560 R3
+	ARDUINO_DEVICE(VENDOR_ID, 0x003f, board_mega),		// Mega ADK
+	ARDUINO_DEVICE(VENDOR_ID, 0x0044, board_mega),		// Mega ADK R3
+	ARDUINO_DEVICE(VENDOR_ID_ORG, 0x0042, board_mega),	// Mega 2560 R3 (arduino.org)
+	ARDUINO_DEVICE(VENDOR_ID, 0x8036, board_leonardo),	// Leonardo
+	ARDUINO_DEVICE(VENDOR_ID_ORG, 0x8036, board_leonardo),	// Leonardo (arduino.org)
 	{ },
 };
 MODULE_DEVICE_TABLE(usb, id_table);
 
 
+/* A bulk in URB and its coherent buffer, kept in flight by the read callback */
+struct device_rx {
+	struct arduino *	dev;
+	struct urb *		urb;
+	ktime_t			submitted;		// for the latency histogram
+};
+
+/* A completed bulk in transfer or a frame, its payload is len bytes of the stream from pos on */
+struct device_rec {
+	unsigned long		pos;			// rx_head when the payload was put into the ring
+	u64			ns;			// ktime_get_ns() at completion
+	u32			len;
+	s32			status;
+};
+
+/* The last size entries of a series of device_rec, filled by the read callback */
+struct device_index {
+	struct device_rec *	slot;
+	unsigned int		size;			// a power of two
+	unsigned long		head;			// entries ever put into slot
+};
+
+/* Where frame mode is within a frame, see device_frame_scan() */
+enum device_frame_state {
+	DEVICE_FRAME_IDLE,
+	DEVICE_FRAME_LINE,
+	DEVICE_FRAME_LEN,
+	DEVICE_FRAME_BODY,
+};
+
+/* A preallocated bulk out URB and its coherent buffer, recycled by the write path */
+struct device_tx {
+	struct arduino *	dev;
+	struct urb *		urb;
+	unsigned int		index;			// bit in arduino.tx_busy
+	ktime_t			submitted;		// for the latency histogram
+	struct device_file *	owner;			// file that gets this transfer's error, NULL for a deadline flush
+};
+
+/* I/O counters, exported under /sys/class/usbmisc/arduN/stats and in debugfs */
+struct device_stats {
+	atomic64_t		bytes_in;		// bytes received from the board
+	atomic64_t		bytes_out;		// bytes sent to the board
+	atomic64_t		urbs_in;		// completed bulk in URBs
+	atomic64_t		urbs_out;		// completed bulk out URBs
+	atomic64_t		short_reads;		// bulk in URBs completed with less than a full buffer
+	atomic64_t		timeouts;		// read() calls that gave up waiting
+	atomic64_t		submit_errors;		// usb_submit_urb() failures, both directions
+	atomic64_t		rx_overruns;		// bytes overwritten before a reader got to them, summed over readers
+	atomic_t		tx_inflight;		// bulk out URBs currently submitted
+	atomic_t		tx_inflight_hwm;	// highest tx_inflight seen
+	atomic64_t		lat_in[ARDUINO_LAT_BUCKETS];	// bulk in submit to complete, in log2 us
+	atomic64_t		lat_out[ARDUINO_LAT_BUCKETS];	// bulk out submit to complete, in log2 us
+};
+
 struct arduino {
 	struct usb_device *	udev;			// the usb device
-	struct usb_interface *	interface;		// the interface for this device
-	unsigned char *		bulk_in_buffer;		// the buffer to receive data
-	size_t			bulk_in_size;		// the size of the receive buffer
+	struct usb_interface *	interface;		// the interface for this device, NULL once it is unplugged
+	struct usb_interface *	comm;			// CDC comm interface claimed for line_state boards, or NULL
+	const struct arduino_board *board;		// I/O configuration picked by the id_table
+	struct device_rx *	rx_pool;		// URBs streaming from the bulk in endpoint
+	unsigned int		rx_count;		// number of entries in rx_pool
+	size_t			bulk_in_size;		// the size of each receive buffer
+	size_t			bulk_in_packet;		// wMaxPacketSize of the bulk in endpoint
 	__u8			bulk_in_endpointAddr;	// the address of the bulk in endpoint
 	__u8			bulk_out_endpointAddr;	// the address of the bulk out endpoint
+	struct usb_anchor	rx_submitted;		// bulk in URBs currently in flight
+	struct usb_anchor	rx_parked;		// bulk in URBs resting after an error, see device_rx_retry()
+	struct delayed_work	rx_retry;		// puts rx_parked back in flight
+	bool			rx_halted;		// the bulk in endpoint stalled, clear it before resubmitting
+	struct arduino_ring_ctrl *rx_ctrl;		// control page in front of rx_ring, shared with mmap()
+	unsigned char *		rx_ring;		// data received from the board, drained by read() or mmap()
+	size_t			rx_size;		// size of rx_ring, a power of two
+	unsigned long		rx_head;		// bytes ever put into rx_ring, rx_ctrl->head is a copy for userspace
+	unsigned long		rx_claim;		// end of the bytes being put into rx_ring, copied to rx_ctrl->claim
+	spinlock_t		rx_lock;		// protects rx_head, rx_recs and rx_frames against the callbacks
+	struct device_index	rx_recs;		// the last completed transfers, for record mode
+	struct device_index	rx_frames;		// the last complete frames, for frame mode
+	enum device_frame_state	frame_state;		// of the frame at the end of the stream
+	unsigned long		frame_start;		// where that frame began
+	u32			frame_need;		// bytes missing from a binary frame
+	atomic_t		readers;		// open files, each one reads the whole stream
+	wait_queue_head_t	rx_wait;		// readers waiting for the ring to fill
+	long			read_timeout;		// jiffies a blocking read() waits for data
+	atomic_t		rx_mapped;		// mappings of rx_ring, it can't be resized under them
+	struct rw_semaphore	io_rwsem;		// shared by I/O, exclusive while the pools are rebuilt or the board goes away
+	struct mutex		write_mutex;		// one write() at a time, keeps the bytes of each write together, taken before io_rwsem
+	struct semaphore	limit_sem;		// counts the free entries of tx_pool
+	atomic_t		tx_released;		// bumped whenever an entry of tx_pool frees up or the pool is rebuilt
+	struct device_tx *	tx_pool;		// bulk out URBs allocated at probe time
+	unsigned long *		tx_busy;		// bitmap of the tx_pool entries in use
+	unsigned int		tx_count;		// number of entries in tx_pool
+	size_t			tx_buf_size;		// size of each tx_pool buffer
+	size_t			bulk_out_size;		// wMaxPacketSize of the bulk out endpoint
+	wait_queue_head_t	tx_wait;		// pollers waiting for a free tx_pool entry
+	unsigned char *		coalesce_buf;		// small writes waiting to fill a bulk packet
+	size_t			coalesce_len;		// bytes in coalesce_buf
+	u64			coalesce_ns;		// coalescing deadline, 0 when disabled
+	struct mutex		coalesce_mutex;		// protects coalesce_buf and coalesce_len
+	struct hrtimer		coalesce_timer;		// fires coalesce_ns after the first buffered byte
+	struct work_struct	coalesce_work;		// flushes coalesce_buf on behalf of the timer
+	int			minor;			// ardu%d, kept for tracing after disconnect
+	struct device_stats	stats;
+	struct dentry *		debugfs;		// this device's file under the module directory
+	struct usb_anchor	submitted;		// bulk out URBs in flight, drained by flush()
+	int			errors;			// last error of a transfer no file owns, see device_coalesce_work()
+	spinlock_t		err_lock;		// protects errors
 	struct kref		kref;
 };
 
 #define to_device_dev(d) container_of(d, struct arduino, kref)
 
+/* An open file of a device, with its own cursor into the receive ring */
+struct device_file {
+	struct arduino *	dev;
+	struct mutex		rx_mutex;		// one read() of this file at a time
+	u32			mode;			// ARDUINO_READ_*
+	unsigned long		tail;			// next byte of the stream this file reads
+	unsigned long		rec_tail;		// next record or frame this file reads, in those modes
+	u64			lost;			// bytes or records lost before this file read them, not reported yet
+	struct kref		kref;			// held by the file and by each of its transfers in flight
+	int			errors;			// last error of this file's transfers, protected by arduino.err_lock
+	atomic_t		tx_inflight;		// transfers of this file not completed yet
+};
+
+static struct dentry *debugfs_root;
+
 static struct usb_driver arduino = {
  .name = "arduino",
  .probe = device_probe,
@@ -72,6 +293,12 @@ static struct file_operations device_fops = {
 .write =	device_write,
 .open =		device_open,
 .release =	device_release,
+.flush =	device_flush,
+.fsync =	device_fsync,
+.poll =		device_poll,
+.mmap =		device_mmap,
+.unlocked_ioctl = device_ioctl,
+.compat_ioctl =	compat_ptr_ioctl,
 };
 
 static struct usb_class_driver device_class = {
@@ -82,20 +309,674 @@ static struct usb_class_driver device_class = {
 };
 
 
+/*
+	*******URB POOLS******
+*/
+static void device_rx_pool_free(struct arduino *dev) {
+	struct urb *urb;
+	int i;
+
+	for (i = 0; dev->rx_pool && i < dev->rx_count; i++) {
+		urb = dev->rx_pool[i].urb;
+		if (!urb)
+			continue;
+		usb_free_coherent(dev->udev, dev->bulk_in_size,
+		urb->transfer_buffer, urb->transfer_dma);
+		usb_free_urb(urb);
+	}
+	kfree (dev->rx_pool);
+	dev->rx_pool = NULL;
+}
+
+/* one coherent buffer per bulk in URB, they are resubmitted straight from the callback */
+static int device_rx_pool_alloc(struct arduino *dev, unsigned int count, size_t size) {
+	struct urb *urb;
+	unsigned char *buf;
+	int i;
+
+	dev->rx_count = count;
+	dev->bulk_in_size = size;
+	dev->rx_pool = kcalloc(dev->rx_count, sizeof(*dev->rx_pool), GFP_KERNEL);
+	if (!dev->rx_pool)
+		return -ENOMEM;
+	for (i = 0; i < dev->rx_count; i++) {
+		urb = usb_alloc_urb(0, GFP_KERNEL);
+		if (!urb)
+			goto error;
+		dev->rx_pool[i].dev = dev;
+		dev->rx_pool[i].urb = urb;
+		buf = usb_alloc_coherent(dev->udev, dev->bulk_in_size, GFP_KERNEL, &urb->transfer_dma);
+		if (!buf) {
+			printk(KERN_INFO "arduino: %d Could not allocate bulk_in buffer\n",dev->udev->devnum);
+			usb_free_urb(urb);
+			dev->rx_pool[i].urb = NULL;
+			goto error;
+		}
+		usb_fill_bulk_urb(urb, dev->udev, usb_rcvbulkpipe(dev->udev, dev->bulk_in_endpointAddr),
+		buf, dev->bulk_in_size, device_read_bulk_callback, &dev->rx_pool[i]);
+		urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+	}
+	return 0;
+
+	error:
+	device_rx_pool_free(dev);
+	return -ENOMEM;
+}
+
+static void device_tx_pool_free(struct arduino *dev) {
+	struct urb *urb;
+	int i;
+
+	for (i = 0; dev->tx_pool && i < dev->tx_count; i++) {
+		urb = dev->tx_pool[i].urb;
+		if (!urb)
+			continue;
+		usb_free_coherent(dev->udev, dev->tx_buf_size,
+		urb->transfer_buffer, urb->transfer_dma);
+		usb_free_urb(urb);
+	}
+	kfree (dev->tx_pool);
+	bitmap_free (dev->tx_busy);
+	dev->tx_pool = NULL;
+	dev->tx_busy = NULL;
+}
+
+/* write URBs are allocated once, their buffers hold a whole number of packets */
+static int device_tx_pool_alloc(struct arduino *dev, unsigned int count) {
+	struct urb *urb;
+	unsigned char *buf;
+	int i;
+
+	dev->tx_count = count;
+	dev->tx_pool = kcalloc(dev->tx_count, sizeof(*dev->tx_pool), GFP_KERNEL);
+	dev->tx_busy = bitmap_zalloc(dev->tx_count, GFP_KERNEL);
+	if (!dev->tx_pool || !dev->tx_busy)
+		goto error;
+	for (i = 0; i < dev->tx_count; i++) {
+		urb = usb_alloc_urb(0, GFP_KERNEL);
+		if (!urb)
+			goto error;
+		dev->tx_pool[i].dev = dev;
+		dev->tx_pool[i].urb = urb;
+		dev->tx_pool[i].index = i;
+		buf = usb_alloc_coherent(dev->udev, dev->tx_buf_size, GFP_KERNEL, &urb->transfer_dma);
+		if (!buf) {
+			printk(KERN_INFO "arduino: %d Could not allocate bulk_out buffer\n",dev->udev->devnum);
+			usb_free_urb(urb);
+			dev->tx_pool[i].urb = NULL;
+			goto error;
+		}
+		usb_fill_bulk_urb(urb, dev->udev, usb_sndbulkpipe(dev->udev, dev->bulk_out_endpointAddr),
+		buf, dev->tx_buf_size, device_write_bulk_callback, &dev->tx_pool[i]);
+		urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+	}
+	sema_init(&dev->limit_sem, dev->tx_count);
+	return 0;
+
+	error:
+	device_tx_pool_free(dev);
+	return -ENOMEM;
+}
+
+/* zeroed and page aligned, it gets mapped into userspace as is */
+static int device_ring_alloc(struct arduino *dev, size_t size) {
+	dev->rx_size = size;
+	dev->rx_ctrl = vmalloc_user(PAGE_SIZE + dev->rx_size);
+	if (!dev->rx_ctrl)
+		return -ENOMEM;
+	dev->rx_ring = (unsigned char *) dev->rx_ctrl + PAGE_SIZE;
+	dev->rx_ctrl->size = dev->rx_size;
+	dev->rx_ctrl->data_offset = PAGE_SIZE;
+	return 0;
+}
+
+
 /*
 	*******FILE OPERATIONS******
 */
 static void device_delete(struct kref *kref )  {
 	struct arduino *dev = to_device_dev(kref);
+
     printk (KERN_INFO "arduino: Deleting device %d", dev->udev->devnum);
+	hrtimer_cancel(&dev->coalesce_timer);
+	cancel_work_sync(&dev->coalesce_work);
+	device_rx_pool_free(dev);
+	device_tx_pool_free(dev);
+	kfree (dev->coalesce_buf);
+	kfree (dev->rx_recs.slot);
+	kfree (dev->rx_frames.slot);
 	usb_put_dev(dev->udev);
-	kfree (dev->bulk_in_buffer);
+	vfree (dev->rx_ctrl);
 	kfree (dev);
 }
 
+/*
+	*******STATISTICS******
+*/
+/* Account a completed URB, returns its latency for the tracepoint */
+static s64 device_stat_latency(atomic64_t *hist, ktime_t submitted) {
+	s64 ns = ktime_to_ns(ktime_sub(ktime_get(), submitted));
+	int bucket = ns >= NSEC_PER_USEC ? fls64(div_u64(ns, NSEC_PER_USEC)) : 0;
+
+	atomic64_inc(&hist[min(bucket, ARDUINO_LAT_BUCKETS - 1)]);
+	return ns;
+}
+
+static void device_stat_tx_submitted(struct arduino *dev) {
+	int inflight = atomic_inc_return(&dev->stats.tx_inflight);
+	int hwm = atomic_read(&dev->stats.tx_inflight_hwm);
+
+	while (inflight > hwm) {
+		if (atomic_try_cmpxchg(&dev->stats.tx_inflight_hwm, &hwm, inflight))
+			break;
+	}
+}
+
+static struct arduino *device_from_class_dev(struct device *d) {
+	/* the ardu%d class device is a child of the interface we are bound to */
+	return usb_get_intfdata(to_usb_interface(d->parent));
+}
+
+#define DEVICE_STAT_ATTR(name)							\
+static ssize_t name##_show(struct device *d, struct device_attribute *attr, char *buf) { \
+	struct arduino *dev = device_from_class_dev(d);				\
+	return sysfs_emit(buf, "%lld\n", (long long)atomic64_read(&dev->stats.name)); \
+}										\
+static DEVICE_ATTR_RO(name)
+
+DEVICE_STAT_ATTR(bytes_in);
+DEVICE_STAT_ATTR(bytes_out);
+DEVICE_STAT_ATTR(urbs_in);
+DEVICE_STAT_ATTR(urbs_out);
+DEVICE_STAT_ATTR(short_reads);
+DEVICE_STAT_ATTR(timeouts);
+DEVICE_STAT_ATTR(submit_errors);
+DEVICE_STAT_ATTR(rx_overruns);
+
+static ssize_t tx_inflight_show(struct device *d, struct device_attribute *attr, char *buf) {
+	struct arduino *dev = device_from_class_dev(d);
+	return sysfs_emit(buf, "%d\n", atomic_read(&dev->stats.tx_inflight));
+}
+static DEVICE_ATTR_RO(tx_inflight);
+
+static ssize_t tx_inflight_hwm_show(struct device *d, struct device_attribute *attr, char *buf) {
+	struct arduino *dev = device_from_class_dev(d);
+	return sysfs_emit(buf, "%d\n", atomic_read(&dev->stats.tx_inflight_hwm));
+}
+static DEVICE_ATTR_RO(tx_inflight_hwm);
+
+/* One count per bucket, bucket i holds latencies below 2^i microseconds */
+static ssize_t device_show_latency(atomic64_t *hist, char *buf) {
+	int len = 0;
+	int i;
+
+	for (i = 0; i < ARDUINO_LAT_BUCKETS; i++)
+		len += sysfs_emit_at(buf, len, "%lld%c", (long long)atomic64_read(&hist[i]),
+		i == ARDUINO_LAT_BUCKETS - 1 ? '\n' : ' ');
+	return len;
+}
+
+static ssize_t latency_in_show(struct device *d, struct device_attribute *attr, char *buf) {
+	return device_show_latency(device_from_class_dev(d)->stats.lat_in, buf);
+}
+static DEVICE_ATTR_RO(latency_in);
+
+static ssize_t latency_out_show(struct device *d, struct device_attribute *attr, char *buf) {
+	return device_show_latency(device_from_class_dev(d)->stats.lat_out, buf);
+}
+static DEVICE_ATTR_RO(latency_out);
+
+static struct attribute *device_stats_attrs[] = {
+	&dev_attr_bytes_in.attr,
+	&dev_attr_bytes_out.attr,
+	&dev_attr_urbs_in.attr,
+	&dev_attr_urbs_out.attr,
+	&dev_attr_short_reads.attr,
+	&dev_attr_timeouts.attr,
+	&dev_attr_submit_errors.attr,
+	&dev_attr_rx_overruns.attr,
+	&dev_attr_tx_inflight.attr,
+	&dev_attr_tx_inflight_hwm.attr,
+	&dev_attr_latency_in.attr,
+	&dev_attr_latency_out.attr,
+	NULL,
+};
+
+static const struct attribute_group device_stats_group = {
+	.name = "stats",
+	.attrs = device_stats_attrs,
+};
+
+/* Everything in one file, for a quick look on a production host */
+static int device_stats_show(struct seq_file *s, void *unused) {
+	struct arduino *dev = s->private;
+	struct device_stats *st = &dev->stats;
+	int i;
+
+	down_read(&dev->io_rwsem);
+	seq_printf(s, "board:           %s\n", dev->board->name);
+	seq_printf(s, "rx_ring:         %zu bytes, %u x %zu byte urbs\n", dev->rx_size, dev->rx_count, dev->bulk_in_size);
+	seq_printf(s, "bytes_in:        %lld\n", (long long)atomic64_read(&st->bytes_in));
+	seq_printf(s, "bytes_out:       %lld\n", (long long)atomic64_read(&st->bytes_out));
+	seq_printf(s, "urbs_in:         %lld\n", (long long)atomic64_read(&st->urbs_in));
+	seq_printf(s, "urbs_out:        %lld\n", (long long)atomic64_read(&st->urbs_out));
+	seq_printf(s, "short_reads:     %lld\n", (long long)atomic64_read(&st->short_reads));
+	seq_printf(s, "timeouts:        %lld\n", (long long)atomic64_read(&st->timeouts));
+	seq_printf(s, "submit_errors:   %lld\n", (long long)atomic64_read(&st->submit_errors));
+	seq_printf(s, "rx_overruns:     %lld\n", (long long)atomic64_read(&st->rx_overruns));
+	seq_printf(s, "rx_readers:      %d\n", atomic_read(&dev->readers));
+	seq_printf(s, "tx_inflight:     %d\n", atomic_read(&st->tx_inflight));
+	seq_printf(s, "tx_inflight_hwm: %d\n", atomic_read(&st->tx_inflight_hwm));
+	seq_printf(s, "tx_pool:         %u x %zu bytes\n", dev->tx_count, dev->tx_buf_size);
+	seq_printf(s, "read_timeout:    %u ms\n", jiffies_to_msecs(READ_ONCE(dev->read_timeout)));
+	up_read(&dev->io_rwsem);
+
+	seq_puts(s, "\nlatency_us        in          out\n");
+	for (i = 0; i < ARDUINO_LAT_BUCKETS; i++)
+		seq_printf(s, "%s%-8llu %-11lld %lld\n", i == ARDUINO_LAT_BUCKETS - 1 ? ">=" : "< ",
+		i == ARDUINO_LAT_BUCKETS - 1 ? 1ULL << (i - 1) : 1ULL << i,
+		(long long)atomic64_read(&st->lat_in[i]),
+		(long long)atomic64_read(&st->lat_out[i]));
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(device_stats);
+
+/*
+	*******RECEIVE RING******
+*/
+/*
+ * Every open file and every mapping reads the whole stream with a cursor
+ * of its own, so the callbacks never wait for a reader: they overwrite the
+ * oldest bytes, and a reader that falls more than rx_size behind loses
+ * them. Before touching the data the producer raises rx_claim to the end
+ * of what it is about to write. A reader that finds the claim
+ * past its copy by more than rx_size copied torn data and retries.
+ *
+ * Called with rx_lock held.
+ */
+static void device_ring_put(struct arduino *dev, const unsigned char *data, size_t len) {
+	unsigned long end = dev->rx_head + len;
+	size_t offset, chunk;
+
+	/* only the newest rx_size bytes would survive anyway */
+	if (len > dev->rx_size) {
+		data += len - dev->rx_size;
+		len = dev->rx_size;
+	}
+	WRITE_ONCE(dev->rx_claim, end);
+	WRITE_ONCE(dev->rx_ctrl->claim, end);
+	/* the claim has to be visible before the data it overwrites */
+	smp_wmb();
+
+	offset = (end - len) & (dev->rx_size - 1);
+	chunk = min(len, dev->rx_size - offset);
+	memcpy(dev->rx_ring + offset, data, chunk);
+	memcpy(dev->rx_ring, data + chunk, len - chunk);
+
+	/*
+	 * publish the bytes before the new head. rx_head is native sized so
+	 * 32-bit kernels can load it atomically, the mapping gets it widened
+	 * to 64 bits with a high word that never changes.
+	 */
+	smp_wmb();
+	WRITE_ONCE(dev->rx_head, end);
+	WRITE_ONCE(dev->rx_ctrl->head, end);
+}
+
+/* Skip what was overwritten since df last read, claim is the producer's rx_claim */
+static void device_file_catch_up(struct device_file *df, unsigned long claim) {
+	struct arduino *dev = df->dev;
+	unsigned long lost;
+
+	if (claim - df->tail <= dev->rx_size)
+		return;
+	lost = claim - dev->rx_size - df->tail;
+	WRITE_ONCE(df->tail, df->tail + lost);
+	WRITE_ONCE(df->lost, df->lost + lost);
+	atomic64_add(lost, &dev->stats.rx_overruns);
+}
+
+/*
+ * Copy up to count bytes from df's cursor, returns 0 when it has caught up
+ * with the stream. Called with io_rwsem and df->rx_mutex held, the
+ * callbacks keep writing meanwhile.
+ */
+static ssize_t device_file_copy(struct device_file *df, char __user *buffer, size_t count) {
+	struct arduino *dev = df->dev;
+	size_t offset, chunk;
+	unsigned long head;
+
+	for (;;) {
+		head = smp_load_acquire(&dev->rx_head);
+		device_file_catch_up(df, READ_ONCE(dev->rx_claim));
+		if (head == df->tail)
+			return 0;
+
+		count = min(count, (size_t)(head - df->tail));
+		offset = df->tail & (dev->rx_size - 1);
+		chunk = min(count, dev->rx_size - offset);
+		if (copy_to_user(buffer, dev->rx_ring + offset, chunk) ||
+		copy_to_user(buffer + chunk, dev->rx_ring, count - chunk))
+			return -EFAULT;
+
+		/* the copy has to be done before looking for a claim that overlaps it */
+		smp_rmb();
+		if (READ_ONCE(dev->rx_claim) - df->tail <= dev->rx_size)
+			break;
+	}
+	WRITE_ONCE(df->tail, df->tail + count);
+	return count;
+}
+
+/* Append an entry to idx, called with rx_lock held */
+static void device_rec_put(struct device_index *idx, unsigned long pos, u64 ns, u32 len, int status) {
+	struct device_rec *rec = &idx->slot[idx->head & (idx->size - 1)];
+
+	rec->pos = pos;
+	rec->ns = ns;
+	rec->len = len;
+	rec->status = status;
+	smp_store_release(&idx->head, idx->head + 1);
+}
+
+/*
+ * Find the frames in len bytes just put into the ring at pos. A frame is
+ * a line up to and including '\n', cut at ARDUINO_FRAME_MAX, or a binary
+ * frame: ARDUINO_FRAME_SOF, a length byte, that many bytes and a check
+ * byte. Checking the frame is left to userspace, the driver only needs
+ * the boundaries. Called with rx_lock held.
+ */
+static void device_frame_scan(struct arduino *dev, const unsigned char *data, size_t len, unsigned long pos, u64 ns) {
+	const unsigned char *nl;
+	size_t i = 0;
+	size_t n;
+
+	while (i < len) {
+		switch (dev->frame_state) {
+		case DEVICE_FRAME_IDLE:
+			dev->frame_start = pos + i;
+			if (data[i++] == ARDUINO_FRAME_SOF) {
+				dev->frame_state = DEVICE_FRAME_LEN;
+				continue;
+			}
+			dev->frame_state = DEVICE_FRAME_LINE;
+			i--;
+			fallthrough;
+		case DEVICE_FRAME_LINE:
+			n = min_t(size_t, len - i, ARDUINO_FRAME_MAX - (pos + i - dev->frame_start));
+			nl = memchr(data + i, '\n', n);
+			i = nl ? nl + 1 - data : i + n;
+			if (nl || pos + i - dev->frame_start == ARDUINO_FRAME_MAX)
+				break;
+			continue;
+		case DEVICE_FRAME_LEN:
+			/* the operands and the check byte */
+			dev->frame_need = data[i++] + 1;
+			dev->frame_state = DEVICE_FRAME_BODY;
+			continue;
+		case DEVICE_FRAME_BODY:
+			n = min_t(size_t, len - i, dev->frame_need);
+			i += n;
+			dev->frame_need -= n;
+			if (!dev->frame_need)
+				break;
+			continue;
+		}
+		device_rec_put(&dev->rx_frames, dev->frame_start, ns, pos + i - dev->frame_start, 0);
+		dev->frame_state = DEVICE_FRAME_IDLE;
+	}
+}
+
+/* The index df reads in its mode, NULL for the byte stream */
+static struct device_index *device_file_index(struct device_file *df) {
+	switch (READ_ONCE(df->mode)) {
+	case ARDUINO_READ_RECORDS:
+		return &df->dev->rx_recs;
+	case ARDUINO_READ_FRAMES:
+		return &df->dev->rx_frames;
+	default:
+		return NULL;
+	}
+}
+
+/* Skip the entries idx no longer holds, called with rx_lock held */
+static void device_file_rec_catch_up(struct device_file *df, struct device_index *idx) {
+	unsigned long lost = idx->head - df->rec_tail;
+
+	if (lost <= idx->size)
+		return;
+	lost -= idx->size;
+	WRITE_ONCE(df->rec_tail, df->rec_tail + lost);
+	WRITE_ONCE(df->lost, df->lost + lost);
+}
+
+/*
+ * Copy the entries of idx to count bytes of buffer. In record mode as
+ * many whole records as fit, each a struct arduino_record and its
+ * payload, in frame mode a single frame. The slots are small enough to
+ * copy under rx_lock, the payload is checked against rx_claim like
+ * device_file_copy() does. Entries whose payload got overwritten are
+ * dropped. Called with io_rwsem and df->rx_mutex held.
+ */
+static ssize_t device_file_copy_records(struct device_file *df, struct device_index *idx, char __user *buffer, size_t count) {
+	struct arduino *dev = df->dev;
+	size_t hdr_size = df->mode == ARDUINO_READ_RECORDS ? sizeof(struct arduino_record) : 0;
+	struct arduino_record hdr;
+	struct device_rec rec;
+	size_t copied = 0;
+	size_t offset, chunk;
+	bool pending;
+	unsigned long seq;
+
+	for (;;) {
+		spin_lock_irq(&dev->rx_lock);
+		device_file_rec_catch_up(df, idx);
+		seq = df->rec_tail;
+		pending = seq != idx->head;
+		if (pending)
+			rec = idx->slot[seq & (idx->size - 1)];
+		spin_unlock_irq(&dev->rx_lock);
+		if (!pending)
+			break;
+
+		/* a record that is gone can't be delivered, however big the buffer */
+		if (rec.len && READ_ONCE(dev->rx_claim) - rec.pos > dev->rx_size)
+			goto lost;
+		if (hdr_size + rec.len > count - copied) {
+			if (!copied)
+				return -EMSGSIZE;
+			break;
+		}
+		if (rec.len) {
+			offset = rec.pos & (dev->rx_size - 1);
+			chunk = min_t(size_t, rec.len, dev->rx_size - offset);
+			if (copy_to_user(buffer + copied + hdr_size, dev->rx_ring + offset, chunk) ||
+			copy_to_user(buffer + copied + hdr_size + chunk, dev->rx_ring, rec.len - chunk))
+				return copied ? copied : -EFAULT;
+			smp_rmb();
+			if (READ_ONCE(dev->rx_claim) - rec.pos > dev->rx_size)
+				goto lost;
+		}
+
+		if (hdr_size) {
+			hdr.timestamp_ns = rec.ns;
+			hdr.seq = seq;
+			hdr.length = rec.len;
+			hdr.status = rec.status;
+			if (copy_to_user(buffer + copied, &hdr, sizeof(hdr)))
+				return copied ? copied : -EFAULT;
+		}
+		copied += hdr_size + rec.len;
+		WRITE_ONCE(df->rec_tail, seq + 1);
+		/* one frame per read(), that is the point of frame mode */
+		if (!hdr_size)
+			break;
+		continue;
+
+		lost:
+		WRITE_ONCE(df->rec_tail, seq + 1);
+		WRITE_ONCE(df->lost, df->lost + 1);
+	}
+	return copied;
+}
+
+/* Whether df has something to read in its mode */
+static bool device_file_readable(struct device_file *df) {
+	struct device_index *idx = device_file_index(df);
+
+	if (idx)
+		return smp_load_acquire(&idx->head) != READ_ONCE(df->rec_tail);
+	return smp_load_acquire(&df->dev->rx_head) != READ_ONCE(df->tail);
+}
+
+/* Whether df lost data, or is about to lose what it didn't read yet */
+static bool device_file_overrun(struct device_file *df) {
+	struct device_index *idx = device_file_index(df);
+	struct arduino *dev = df->dev;
+
+	if (READ_ONCE(df->lost))
+		return true;
+	if (idx)
+		return READ_ONCE(idx->head) - READ_ONCE(df->rec_tail) > idx->size;
+	return READ_ONCE(dev->rx_claim) - READ_ONCE(df->tail) > READ_ONCE(dev->rx_size);
+}
+
+static int device_rx_submit(struct arduino *dev, struct device_rx *rx, gfp_t mem_flags) {
+	int retval;
+
+	rx->submitted = ktime_get();
+	usb_anchor_urb(rx->urb, &dev->rx_submitted);
+	retval = usb_submit_urb(rx->urb, mem_flags);
+	if (retval) {
+		usb_unanchor_urb(rx->urb);
+		if (retval != -EPERM)
+			atomic64_inc(&dev->stats.submit_errors);
+	}
+	return retval;
+}
+
+/* Called with io_rwsem held exclusive, or before the device is registered */
+/* Set DTR and RTS, bits of ARDUINO_CTRL_*, through the comm interface */
+static int device_comm_lines(struct arduino *dev, u16 lines) {
+	return usb_control_msg_send(dev->udev, 0, USB_CDC_REQ_SET_CONTROL_LINE_STATE,
+	USB_TYPE_CLASS | USB_RECIP_INTERFACE, lines, dev->comm->cur_altsetting->desc.bInterfaceNumber,
+	NULL, 0, USB_CTRL_SET_TIMEOUT, GFP_KERNEL);
+}
+
+/*
+ * The 32U4's USB stack hands bytes to the sketch, and Serial tests true,
+ * only once the host set a line coding and raised DTR, the way a terminal
+ * opens the port. Those requests go to the comm interface, which sits
+ * right before the data interface, so probe claims it for us.
+ */
+static int device_comm_claim(struct arduino *dev, int data_ifnum) {
+	struct usb_interface *comm;
+	int retval;
+
+	comm = usb_ifnum_to_if(dev->udev, data_ifnum - 1);
+	if (!comm || comm->cur_altsetting->desc.bInterfaceClass != USB_CLASS_COMM)
+		return -ENODEV;
+
+	/* no intfdata, device_disconnect() tells the comm interface by that */
+	retval = usb_driver_claim_interface(&arduino, comm, NULL);
+	if (retval)
+		return retval;
+	dev->comm = comm;
+	return 0;
+}
+
+/* Called once streaming runs, so nothing the sketch sends on DTR is lost */
+static int device_comm_open(struct arduino *dev) {
+	struct usb_cdc_line_coding coding = {
+		.dwDTERate	= cpu_to_le32(ARDUINO_LINE_RATE),
+		.bCharFormat	= USB_CDC_1_STOP_BITS,
+		.bParityType	= USB_CDC_NO_PARITY,
+		.bDataBits	= 8,
+	};
+	int retval;
+
+	retval = usb_control_msg_send(dev->udev, 0, USB_CDC_REQ_SET_LINE_CODING,
+	USB_TYPE_CLASS | USB_RECIP_INTERFACE, 0, dev->comm->cur_altsetting->desc.bInterfaceNumber,
+	&coding, sizeof(coding), USB_CTRL_SET_TIMEOUT, GFP_KERNEL);
+	if (retval)
+		return retval;
+	return device_comm_lines(dev, ARDUINO_CTRL_DTR | ARDUINO_CTRL_RTS);
+}
+
+/* Drop DTR, which fails harmlessly on an unplugged board, and hand the comm interface back */
+static void device_comm_release(struct arduino *dev) {
+	if (!dev->comm)
+		return;
+	device_comm_lines(dev, 0);
+	usb_driver_release_interface(&arduino, dev->comm);
+	dev->comm = NULL;
+}
+
+static void device_rx_stop(struct arduino *dev) {
+	usb_kill_anchored_urbs(&dev->rx_submitted);
+	/* the retry can't run meanwhile, it only trylocks io_rwsem */
+	cancel_delayed_work_sync(&dev->rx_retry);
+	usb_scuttle_anchored_urbs(&dev->rx_parked);
+	WRITE_ONCE(dev->rx_halted, false);
+}
+
+/*
+ * Put the bulk in URBs a transfer error retired back in flight, after
+ * clearing the halt of a stalled endpoint, as cdc-acm does.
+ */
+static void device_rx_retry(struct work_struct *work) {
+	struct arduino *dev = container_of(to_delayed_work(work), struct arduino, rx_retry);
+	struct urb *urb;
+	int retval;
+
+	/* a retune or disconnect holding it exclusive cancels us, don't wait for it */
+	if (!down_read_trylock(&dev->io_rwsem)) {
+		schedule_delayed_work(&dev->rx_retry, ARDUINO_RX_RETRY);
+		return;
+	}
+	if (!dev->interface)
+		goto exit;
+
+	if (READ_ONCE(dev->rx_halted)) {
+		WRITE_ONCE(dev->rx_halted, false);
+		retval = usb_clear_halt(dev->udev, usb_rcvbulkpipe(dev->udev, dev->bulk_in_endpointAddr));
+		if (retval)
+			dev_err(&dev->interface->dev, "%s - failed clearing the bulk in halt, error %d\n",
+			__func__, retval);
+	}
+	while ((urb = usb_get_from_anchor(&dev->rx_parked))) {
+		retval = device_rx_submit(dev, urb->context, GFP_KERNEL);
+		usb_put_urb(urb);
+		if (retval && retval != -EPERM)
+			dev_err(&dev->interface->dev, "%s - failed resubmitting read urb, error %d\n",
+			__func__, retval);
+	}
+
+	exit:
+	up_read(&dev->io_rwsem);
+}
+
+/* Put every bulk in URB in flight, the callbacks keep them there until device_rx_stop() */
+static int device_rx_start(struct arduino *dev) {
+	int i;
+	int retval;
+
+	for (i = 0; i < dev->rx_count; i++) {
+		retval = device_rx_submit(dev, &dev->rx_pool[i], GFP_KERNEL);
+		if (retval) {
+			dev_err(&dev->interface->dev, "%s - failed submitting read urb, error %d\n",
+			__func__, retval);
+			device_rx_stop(dev);
+			return retval;
+		}
+	}
+	return 0;
+}
+
 
 static int device_open(struct inode *inode, struct file *file )  {
 	struct arduino *dev;
+	struct device_file *df;
 	struct usb_interface *interface;
 	int subminor;
 	int retval = 0;
@@ -104,122 +985,978 @@ static int device_open(struct inode *inode, struct file *file )  {
 
 	interface = usb_find_interface(&arduino, subminor);
 	if (!interface) {
-		printk(KERN_INFO "arduino: %s - error, can't find device for minor %d",
-				     __FUNCTION__, subminor);
+		pr_debug("arduino: %s - error, can't find device for minor %d\n",
+				     __func__, subminor);
 		retval = -ENODEV;
-		return retval;
+		goto exit;
 	}
 
 	dev = usb_get_intfdata(interface);
 	if (!dev) {
 		retval = -ENODEV;
-		return retval;
+		goto exit;
+	}
+
+	df = kzalloc(sizeof(*df), GFP_KERNEL);
+	if (!df) {
+		retval = -ENOMEM;
+		goto exit;
 	}
+	df->dev = dev;
+	kref_init(&df->kref);
+	mutex_init(&df->rx_mutex);
+	/* the stream starts for a file when it is opened */
+	df->mode = ARDUINO_READ_BYTES;
+	df->tail = smp_load_acquire(&dev->rx_head);
 
 	kref_get(&dev->kref);
-	file->private_data = dev;
+	atomic_inc(&dev->readers);
+	file->private_data = df;
 
+	exit:
+	trace_arduino_open(subminor, retval);
 	return retval;
 }	
 
+/* The last transfer of a closed file may complete in interrupt context */
+static void device_file_free(struct kref *kref) {
+	kfree(container_of(kref, struct device_file, kref));
+}
+
 static int device_release(struct inode *inode, struct file *file )  {
+	struct device_file *df;
 	struct arduino *dev;
 
-	dev = (struct arduino *) file->private_data;
-	if (dev == NULL)
+	df = (struct device_file *) file->private_data;
+	if (df == NULL)
 		return -ENODEV;
+	dev = df->dev;
 
+	atomic_dec(&dev->readers);
+	kref_put(&df->kref, device_file_free);
 	kref_put(&dev->kref, device_delete);
 	return 0;
 }
 
-static ssize_t device_read(struct file *file, char __user *buffer, size_t count, loff_t *ppos) {
-	int count_int = (int) count;
-	struct arduino *dev;
-	int retval = 0;
+/* Keep the pools and the ring in place for an I/O call, see device_tune() */
+static int device_io_lock_any(struct arduino *dev, bool nonblock) {
+	if (nonblock)
+		return down_read_trylock(&dev->io_rwsem) ? 0 : -EAGAIN;
+	return down_read_interruptible(&dev->io_rwsem) ? -ERESTARTSYS : 0;
+}
 
-	dev = (struct arduino*) file->private_data;
+/* As device_io_lock_any(), for calls that need the board, disconnect clears interface under the lock */
+static int device_io_lock(struct arduino *dev, bool nonblock) {
+	int retval = device_io_lock_any(dev, nonblock);
 
-	retval = usb_bulk_msg(dev->udev,
-	      usb_rcvbulkpipe(dev->udev, dev->bulk_in_endpointAddr),
-	      dev->bulk_in_buffer,
-	      min(dev->bulk_in_size, count),
-	      &count_int, HZ*10);
+	if (retval)
+		return retval;
+	if (!dev->interface) {
+		up_read(&dev->io_rwsem);
+		return -ENODEV;
+	}
+	return 0;
+}
 
-	if (!retval) {
-		if (copy_to_user(buffer, dev->bulk_in_buffer, count))
-				retval = -EFAULT;
+/*
+ * Take the file's cursor, nonblocking IO shall not wait, not even for
+ * another reader. The ring outlives the board, what arrived before the
+ * disconnect can still be read.
+ */
+static int device_rx_lock(struct device_file *df, bool nonblock) {
+	struct arduino *dev = df->dev;
+	int retval = device_io_lock_any(dev, nonblock);
+
+	if (retval)
+		return retval;
+	if (nonblock) {
+		if (!mutex_trylock(&df->rx_mutex)) {
+			up_read(&dev->io_rwsem);
+			return -EAGAIN;
+		}
+		return 0;
+	}
+	if (mutex_lock_interruptible(&df->rx_mutex)) {
+		up_read(&dev->io_rwsem);
+		return -ERESTARTSYS;
+	}
+	return 0;
+}
+
+static void device_rx_unlock(struct device_file *df) {
+	mutex_unlock(&df->rx_mutex);
+	up_read(&df->dev->io_rwsem);
+}
+
+static ssize_t device_do_read(struct file *file, char __user *buffer, size_t count) {
+	struct device_file *df = (struct device_file *) file->private_data;
+	struct arduino *dev = df->dev;
+	struct device_index *idx;
+	ssize_t retval;
+	long timeout;
+	bool nonblock = file->f_flags & O_NONBLOCK;
+
+	if (count == 0)
+		return 0;
+
+	timeout = READ_ONCE(dev->read_timeout);
+	for (;;) {
+		retval = device_rx_lock(df, nonblock);
+		if (retval)
+			return retval;
+		idx = device_file_index(df);
+		if (idx)
+			retval = device_file_copy_records(df, idx, buffer, count);
 		else
-			retval = count;
+			retval = device_file_copy(df, buffer, count);
+		device_rx_unlock(df);
+		if (retval)
+			return retval;
+
+		if (!READ_ONCE(dev->interface))
+			return -ENODEV;
+		if (nonblock)
+			return -EAGAIN;
+
+		/*
+		 * The bulk in URBs are always streaming, we only wait for them to
+		 * fill the ring. Wait unlocked, so the ring can be rebuilt meanwhile,
+		 * rx_head and the indexes live in dev and survive that.
+		 */
+		timeout = wait_event_interruptible_timeout(dev->rx_wait,
+		device_file_readable(df) || !READ_ONCE(dev->interface),
+		timeout);
+		if (timeout < 0)
+			return timeout;
+		if (timeout == 0) {
+			atomic64_inc(&dev->stats.timeouts);
+			return -ETIMEDOUT;
+		}
 	}
+}
+
+static ssize_t device_read(struct file *file, char __user *buffer, size_t count, loff_t *ppos) {
+	struct arduino *dev = ((struct device_file *) file->private_data)->dev;
+	ktime_t start = trace_arduino_read_enabled() ? ktime_get() : 0;
+	ssize_t retval;
+
+	retval = device_do_read(file, buffer, count);
 
-	printk(KERN_INFO "arduino: Error reading retval=%d\n",retval);
+	trace_arduino_read(dev->minor, count, retval, start ? ktime_to_ns(ktime_sub(ktime_get(), start)) : 0);
 	return retval;
 }
 
-static void device_write_bulk_callback(struct urb *urb )  {
-	if (urb->status &&
-	!(urb->status == -ENOENT ||
-	urb->status == -ECONNRESET ||
-	urb->status == -ESHUTDOWN)) {
-		printk(KERN_INFO "arduino: %s - nonzero write bulk status received: %d\n",
-		__FUNCTION__, urb->status);
+/* Hand a completed transfer to the readers: its payload to the stream, its record and frames to those modes */
+static void device_rx_record(struct arduino *dev, const unsigned char *data, u32 len, int status) {
+	u64 ns = ktime_get_ns();
+	unsigned long flags;
+	unsigned long pos;
+
+	spin_lock_irqsave(&dev->rx_lock, flags);
+	pos = dev->rx_head;
+	if (len) {
+		device_ring_put(dev, data, len);
+		device_frame_scan(dev, data, len, pos, ns);
+	}
+	device_rec_put(&dev->rx_recs, pos, ns, len, status);
+	spin_unlock_irqrestore(&dev->rx_lock, flags);
+	wake_up(&dev->rx_wait);
+}
+
+static void device_read_bulk_callback(struct urb *urb )  {
+	struct device_rx *rx = urb->context;
+	struct arduino *dev = rx->dev;
+	int retval;
+	s64 latency;
+
+	switch (urb->status) {
+	case 0:
+		break;
+	case -ENOENT:
+	case -ECONNRESET:
+	case -ESHUTDOWN:
+		/* killed by device_rx_stop(), stay idle */
+		return;
+	case -EPIPE:
+		WRITE_ONCE(dev->rx_halted, true);
+		fallthrough;
+	case -EPROTO:
+	case -EILSEQ:
+	case -ETIME:
+	case -EOVERFLOW:
+		/* resubmitting right away would spin if the board is going away, rest a while */
+		dev_err_ratelimited(&dev->udev->dev, "%s - read bulk status %d, retrying urb\n",
+		__func__, urb->status);
+		device_rx_record(dev, NULL, 0, urb->status);
+		usb_anchor_urb(urb, &dev->rx_parked);
+		schedule_delayed_work(&dev->rx_retry, ARDUINO_RX_RETRY);
+		return;
+	default:
+		dev_err_ratelimited(&dev->udev->dev, "%s - nonzero read bulk status received: %d\n",
+		__func__, urb->status);
+		device_rx_record(dev, NULL, 0, urb->status);
+		goto resubmit;
 	}
 
-	usb_free_coherent(urb->dev, urb->transfer_buffer_length,
-	urb->transfer_buffer, urb->transfer_dma);
+	atomic64_inc(&dev->stats.urbs_in);
+	atomic64_add(urb->actual_length, &dev->stats.bytes_in);
+	if (urb->actual_length < urb->transfer_buffer_length)
+		atomic64_inc(&dev->stats.short_reads);
+	latency = device_stat_latency(dev->stats.lat_in, rx->submitted);
+	trace_arduino_urb_complete(dev->minor, true, urb->status, urb->actual_length, latency);
+
+	/* zero length packets only end transfers, they are not worth a record */
+	if (urb->actual_length)
+		device_rx_record(dev, urb->transfer_buffer, urb->actual_length, 0);
+
+	resubmit:
+	retval = device_rx_submit(dev, rx, GFP_ATOMIC);
+	if (retval && retval != -EPERM)
+		dev_err_ratelimited(&dev->udev->dev, "%s - failed resubmitting read urb, error %d\n",
+		__func__, retval);
 }
 
-static ssize_t device_write(struct file *file, const char __user *user_buffer, size_t count, loff_t *ppos) {
+/* Report an error recorded by a write callback once, called with err_lock held */
+static int device_error_take(int *errors) {
+	int retval = *errors;
 
+	if (!retval)
+		return 0;
+	*errors = 0;
+	return (retval == -EPIPE) ? retval : -EIO;
+}
+
+static int device_flush(struct file *file, fl_owner_t id) {
+	struct device_file *df;
 	struct arduino *dev;
+	int res;
+
+	df = (struct device_file *) file->private_data;
+	if (df == NULL)
+		return -ENODEV;
+	dev = df->dev;
+
+	/* a reader has nothing to push out, other files' writes are none of its business */
+	if (!(file->f_mode & FMODE_WRITE))
+		return 0;
+
+	/* push out whatever is being coalesced and give this file's transfers time to reach the board */
+	if (READ_ONCE(dev->interface)) {
+		device_coalesce_drain(dev, df);
+		wait_event_timeout(dev->tx_wait, !atomic_read(&df->tx_inflight), HZ);
+	}
+
+	/* read out the errors of this file's writes */
+	spin_lock_irq(&dev->err_lock);
+	res = device_error_take(&df->errors);
+	spin_unlock_irq(&dev->err_lock);
+
+	return res;
+}
+
+/*
+ * Take a free entry of tx_pool. The caller owns a limit_sem count, which
+ * guarantees a clear bit exists, so racing writers just retry the search.
+ */
+static struct device_tx *device_tx_get(struct arduino *dev) {
+	unsigned int i;
+
+	do {
+		i = find_first_zero_bit(dev->tx_busy, dev->tx_count);
+	} while (i >= dev->tx_count || test_and_set_bit_lock(i, dev->tx_busy));
+
+	return &dev->tx_pool[i];
+}
+
+static void device_tx_put(struct arduino *dev, struct device_tx *tx) {
+	struct device_file *owner = tx->owner;
+
+	tx->owner = NULL;
+	clear_bit_unlock(tx->index, dev->tx_busy);
+	up(&dev->limit_sem);
+	atomic_inc(&dev->tx_released);
+	if (owner)
+		atomic_dec(&owner->tx_inflight);
+	wake_up(&dev->tx_wait);
+	if (owner)
+		kref_put(&owner->kref, device_file_free);
+}
+
+/*
+ * Reserve a tx_pool entry, -EAGAIN once the pipeline is full. Callers
+ * that block wait in device_tx_wait() with io_rwsem dropped, so a writer
+ * stuck on a board that stopped draining never holds up a retune.
+ * Errors of the owner's earlier writes, or else of deadline flushes nobody
+ * owns, are reported once, through the next reservation.
+ */
+static int device_tx_reserve(struct arduino *dev, struct device_file *owner) {
+	int retval;
+
+	if (down_trylock(&dev->limit_sem))
+		return -EAGAIN;
+
+	spin_lock_irq(&dev->err_lock);
+	retval = owner ? device_error_take(&owner->errors) : 0;
+	if (!retval)
+		retval = device_error_take(&dev->errors);
+	spin_unlock_irq(&dev->err_lock);
+
+	if (retval < 0)
+		up(&dev->limit_sem);
+	return retval;
+}
+
+/*
+ * Wait until an entry of tx_pool was released after the caller read seen
+ * from tx_released, or the board went away. Called with no lock held,
+ * the pool may have been rebuilt meanwhile.
+ */
+static int device_tx_wait(struct arduino *dev, int seen) {
+	if (wait_event_interruptible(dev->tx_wait,
+	atomic_read(&dev->tx_released) != seen || !READ_ONCE(dev->interface)))
+		return -ERESTARTSYS;
+	return 0;
+}
+
+/* Send len bytes of tx's buffer on behalf of owner, the entry goes back to the pool on failure */
+static int device_tx_submit(struct arduino *dev, struct device_tx *tx, size_t len, struct device_file *owner) {
+	struct urb *urb = tx->urb;
+	int retval;
+
+	if (owner) {
+		kref_get(&owner->kref);
+		atomic_inc(&owner->tx_inflight);
+		tx->owner = owner;
+	}
+	urb->transfer_buffer_length = len;
+	usb_anchor_urb(urb, &dev->submitted);
+
+	tx->submitted = ktime_get();
+	device_stat_tx_submitted(dev);
+	retval = usb_submit_urb(urb, GFP_KERNEL);
+	if (retval) {
+		dev_err_ratelimited(&dev->udev->dev, "%s - failed submitting write urb, error %d\n",
+		__func__, retval);
+		atomic_dec(&dev->stats.tx_inflight);
+		atomic64_inc(&dev->stats.submit_errors);
+		usb_unanchor_urb(urb);
+		device_tx_put(dev, tx);
+	}
+	return retval;
+}
+
+/*
+ * Send the coalesced bytes, called with coalesce_mutex held. They stay
+ * buffered unless the submit succeeds. The transfer's error goes to owner,
+ * the file that filled or drained the buffer.
+ */
+static int device_coalesce_flush(struct arduino *dev, struct device_file *owner) {
+	struct device_tx *tx;
+	int retval;
+
+	if (!dev->coalesce_len)
+		return 0;
+
+	retval = device_tx_reserve(dev, owner);
+	if (retval)
+		return retval;
+
+	tx = device_tx_get(dev);
+	memcpy(tx->urb->transfer_buffer, dev->coalesce_buf, dev->coalesce_len);
+	retval = device_tx_submit(dev, tx, dev->coalesce_len, owner);
+	if (!retval)
+		dev->coalesce_len = 0;
+	return retval;
+}
+
+/* Flush on behalf of fsync()/close() or when coalescing gets disabled, called with no lock held */
+static int device_coalesce_drain(struct arduino *dev, struct device_file *owner) {
+	int retval;
+	int seen;
+
+	for (;;) {
+		retval = device_io_lock(dev, false);
+		if (retval)
+			return retval;
+		mutex_lock(&dev->coalesce_mutex);
+		hrtimer_cancel(&dev->coalesce_timer);
+		seen = atomic_read(&dev->tx_released);
+		retval = device_coalesce_flush(dev, owner);
+		mutex_unlock(&dev->coalesce_mutex);
+		up_read(&dev->io_rwsem);
+
+		if (retval != -EAGAIN)
+			return retval;
+		retval = device_tx_wait(dev, seen);
+		if (retval)
+			return retval;
+	}
+}
+
+static enum hrtimer_restart device_coalesce_timer(struct hrtimer *timer) {
+	struct arduino *dev = container_of(timer, struct arduino, coalesce_timer);
+
+	/* the flush may have to wait for a free URB, do it from process context */
+	schedule_work(&dev->coalesce_work);
+	return HRTIMER_NORESTART;
+}
+
+static void device_coalesce_work(struct work_struct *work) {
+	struct arduino *dev = container_of(work, struct arduino, coalesce_work);
+	int retval;
+
+	/* like any other I/O, the board has to be there and the pool in place */
+	down_read(&dev->io_rwsem);
+	if (!dev->interface) {
+		up_read(&dev->io_rwsem);
+		return;
+	}
+	mutex_lock(&dev->coalesce_mutex);
+	retval = device_coalesce_flush(dev, NULL);
+	/* every URB is in flight, try again after another deadline */
+	if (retval == -EAGAIN && dev->coalesce_ns)
+		hrtimer_start(&dev->coalesce_timer, ns_to_ktime(dev->coalesce_ns), HRTIMER_MODE_REL);
+	mutex_unlock(&dev->coalesce_mutex);
+	up_read(&dev->io_rwsem);
+
+	/* nobody is waiting on the deadline, report it with the next write */
+	if (retval < 0 && retval != -EAGAIN) {
+		spin_lock_irq(&dev->err_lock);
+		dev->errors = retval;
+		spin_unlock_irq(&dev->err_lock);
+	}
+}
+
+/*
+ * Coalescing write: bytes are appended to coalesce_buf, which is sent as
+ * soon as it holds a full bulk packet. The first byte of a packet arms the
+ * deadline timer, so nothing stays buffered longer than coalesce_ns.
+ * With coalescing turned off, a leftover that couldn't be drained goes
+ * out together with the first bytes written after it, there is no
+ * deadline to wait for. Returns short, or -EAGAIN, once every URB is in
+ * flight.
+ */
+static ssize_t device_write_coalesced(struct arduino *dev, struct device_file *df, const char __user *user_buffer, size_t count) {
+	u64 ns = READ_ONCE(dev->coalesce_ns);
+	size_t written = 0;
+	size_t chunk;
+	int retval = 0;
+
+	if (mutex_lock_interruptible(&dev->coalesce_mutex))
+		return -ERESTARTSYS;
+
+	while (written < count) {
+		chunk = min(count - written, dev->bulk_out_size - dev->coalesce_len);
+		if (copy_from_user(dev->coalesce_buf + dev->coalesce_len, user_buffer + written, chunk)) {
+			retval = -EFAULT;
+			break;
+		}
+		if (!dev->coalesce_len && ns)
+			hrtimer_start(&dev->coalesce_timer, ns_to_ktime(ns), HRTIMER_MODE_REL);
+		dev->coalesce_len += chunk;
+		written += chunk;
+
+		if (dev->coalesce_len == dev->bulk_out_size || !ns) {
+			hrtimer_try_to_cancel(&dev->coalesce_timer);
+			retval = device_coalesce_flush(dev, df);
+			if (retval) {
+				/* the packet stays buffered, the timer retries it unless the board is going away */
+				if (ns && retval != -ENODEV && retval != -ENOENT && retval != -ESHUTDOWN)
+					hrtimer_start(&dev->coalesce_timer, ns_to_ktime(ns), HRTIMER_MODE_REL);
+				written -= chunk;
+				dev->coalesce_len -= chunk;
+				break;
+			}
+			/* the leftover is out, the rest of the write can go direct */
+			if (!ns)
+				break;
+		}
+	}
+
+	mutex_unlock(&dev->coalesce_mutex);
+	return written ? written : retval;
+}
+
+static void device_write_bulk_callback(struct urb *urb )  {
+	struct device_tx *tx = urb->context;
+	struct arduino *dev = tx->dev;
+	s64 latency;
+
+	if (urb->status) {
+		if (!(urb->status == -ENOENT ||
+		urb->status == -ECONNRESET ||
+		urb->status == -ESHUTDOWN))
+			dev_err_ratelimited(&dev->udev->dev, "%s - nonzero write bulk status received: %d\n",
+			__func__, urb->status);
+
+		spin_lock(&dev->err_lock);
+		if (tx->owner)
+			tx->owner->errors = urb->status;
+		else
+			dev->errors = urb->status;
+		spin_unlock(&dev->err_lock);
+	} else {
+		atomic64_inc(&dev->stats.urbs_out);
+		atomic64_add(urb->actual_length, &dev->stats.bytes_out);
+	}
+	latency = device_stat_latency(dev->stats.lat_out, tx->submitted);
+	trace_arduino_urb_complete(dev->minor, false, urb->status, urb->actual_length, latency);
+	atomic_dec(&dev->stats.tx_inflight);
+
+	device_tx_put(dev, tx);
+}
+
+/* Send one write() as its own transfer, up to a tx_pool buffer of it */
+static ssize_t device_write_direct(struct arduino *dev, struct device_file *df, const char __user *user_buffer, size_t count) {
 	int retval = 0;
-	struct urb *urb = NULL;
-	char *buf = NULL;
+	struct device_tx *tx;
+	size_t writesize = min(count, dev->tx_buf_size);
 
-	dev = (struct arduino *) file->private_data;
+	retval = device_tx_reserve(dev, df);
+	if (retval)
+		return retval;
+
+	/* no allocation here, the URB and its buffer come from the pool built by probe */
+	tx = device_tx_get(dev);
+	if (copy_from_user(tx->urb->transfer_buffer, user_buffer, writesize)) {
+		device_tx_put(dev, tx);
+		return -EFAULT;
+	}
+
+	retval = device_tx_submit(dev, tx, writesize, df);
+	if (retval)
+		return retval;
+
+	return writesize;
+}
+
+/*
+ * Hand count bytes to the pipeline. Once it is full the writer waits
+ * with io_rwsem dropped and takes it again for the next try, so it finds
+ * the pool as a retune may have rebuilt it meanwhile.
+ */
+static ssize_t device_do_write(struct file *file, const char __user *user_buffer, size_t count) {
+	struct device_file *df = (struct device_file *) file->private_data;
+	struct arduino *dev = df->dev;
+	ssize_t retval = 0;
+	size_t written = 0;
+	bool nonblock = file->f_flags & O_NONBLOCK;
+	bool coalesced;
+	int seen;
 
 	if (count == 0)
-		goto exit;
+		return 0;
 
-	urb = usb_alloc_urb(0, GFP_KERNEL);
-	if (!urb) {
-		retval = -ENOMEM;
-		goto error;
+	if (nonblock ? !mutex_trylock(&dev->write_mutex) : mutex_lock_interruptible(&dev->write_mutex))
+		return nonblock ? -EAGAIN : -ERESTARTSYS;
+
+	while (written < count) {
+		retval = device_io_lock(dev, nonblock);
+		if (retval)
+			break;
+		seen = atomic_read(&dev->tx_released);
+		/* buffered data has to go out first to keep the stream in order */
+		coalesced = READ_ONCE(dev->coalesce_ns) || READ_ONCE(dev->coalesce_len);
+		if (coalesced)
+			retval = device_write_coalesced(dev, df, user_buffer + written, count - written);
+		else
+			retval = device_write_direct(dev, df, user_buffer + written, count - written);
+		up_read(&dev->io_rwsem);
+
+		if (retval > 0) {
+			written += retval;
+			/* a direct write is one transfer, whatever fits in it */
+			if (!coalesced)
+				break;
+			continue;
+		}
+		if (retval != -EAGAIN || nonblock)
+			break;
+		retval = device_tx_wait(dev, seen);
+		if (retval)
+			break;
 	}
-	buf =  usb_alloc_coherent(dev->udev, count, GFP_KERNEL, &urb->transfer_dma);
-	if (!buf) {
-		retval = -ENOMEM;
-		goto error;
+
+	mutex_unlock(&dev->write_mutex);
+	return written ? written : retval;
+}
+
+static ssize_t device_write(struct file *file, const char __user *user_buffer, size_t count, loff_t *ppos) {
+	struct arduino *dev = ((struct device_file *) file->private_data)->dev;
+	ktime_t start = trace_arduino_write_enabled() ? ktime_get() : 0;
+	ssize_t retval;
+
+	retval = device_do_write(file, user_buffer, count);
+
+	trace_arduino_write(dev->minor, count, retval, start ? ktime_to_ns(ktime_sub(ktime_get(), start)) : 0);
+	return retval;
+}
+
+static int device_fsync(struct file *file, loff_t start, loff_t end, int datasync) {
+	struct device_file *df = (struct device_file *) file->private_data;
+	struct arduino *dev = df->dev;
+	int retval;
+
+	retval = device_coalesce_drain(dev, df);
+	if (retval == -ENODEV)
+		return retval;
+	if (!usb_wait_anchor_empty_timeout(&dev->submitted, 1000))
+		retval = retval ? retval : -ETIMEDOUT;
+	return retval;
+}
+
+/*
+ * Readable while the stream holds data this file has not read, writable
+ * while the write pipeline has a free URB (or coalescing buffers the write
+ * anyway). EPOLLPRI flags data lost to an overrun, see ARDUINO_IOC_GET_OVERRUNS.
+ * Never sleeps on io_rwsem: the stream state is read locklessly, and
+ * during a retune writability waits for the wakeup the rebuilt pool sends.
+ */
+static __poll_t device_poll(struct file *file, poll_table *wait) {
+	struct device_file *df = (struct device_file *) file->private_data;
+	struct arduino *dev = df->dev;
+	__poll_t mask = 0;
+
+	poll_wait(file, &dev->rx_wait, wait);
+	poll_wait(file, &dev->tx_wait, wait);
+
+	if (device_file_readable(df))
+		mask |= EPOLLIN | EPOLLRDNORM;
+	if (device_file_overrun(df))
+		mask |= EPOLLPRI;
+	if (READ_ONCE(dev->coalesce_ns))
+		mask |= EPOLLOUT | EPOLLWRNORM;
+	else if (down_read_trylock(&dev->io_rwsem)) {
+		if (!bitmap_full(dev->tx_busy, dev->tx_count))
+			mask |= EPOLLOUT | EPOLLWRNORM;
+		up_read(&dev->io_rwsem);
 	}
-	if (copy_from_user(buf, user_buffer, count)) {
-		retval = -EFAULT;
-		goto error;
+	if (!READ_ONCE(dev->interface))
+		mask |= EPOLLHUP | EPOLLERR;
+
+	return mask;
+}
+
+/*
+ * Map the receive ring: the control page first, then the data pages.
+ * Like an open file, every mapping reads the whole stream, following
+ * head with a cursor it keeps in userspace.
+ */
+static void device_vm_open(struct vm_area_struct *vma) {
+	struct arduino *dev = vma->vm_private_data;
+
+	atomic_inc(&dev->rx_mapped);
+}
+
+static void device_vm_close(struct vm_area_struct *vma) {
+	struct arduino *dev = vma->vm_private_data;
+
+	atomic_dec(&dev->rx_mapped);
+}
+
+/* Counts the mappings, the file each one holds keeps dev alive */
+static const struct vm_operations_struct device_vm_ops = {
+	.open =		device_vm_open,
+	.close =	device_vm_close,
+};
+
+static int device_mmap(struct file *file, struct vm_area_struct *vma) {
+	struct arduino *dev = ((struct device_file *) file->private_data)->dev;
+	int retval;
+
+	if (vma->vm_pgoff)
+		return -EINVAL;
+	/* the control page is the driver's, consumers keep their cursors to themselves */
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vm_flags_clear(vma, VM_MAYWRITE);
+
+	down_read(&dev->io_rwsem);
+	if (vma->vm_end - vma->vm_start > PAGE_SIZE + dev->rx_size) {
+		retval = -EINVAL;
+		goto exit;
 	}
+	retval = remap_vmalloc_range(vma, dev->rx_ctrl, 0);
+	if (retval)
+		goto exit;
+	vma->vm_ops = &device_vm_ops;
+	vma->vm_private_data = dev;
+	device_vm_open(vma);
 
-	usb_fill_bulk_urb(urb, dev->udev, usb_sndbulkpipe(dev->udev, dev->bulk_out_endpointAddr),
-	buf, count, device_write_bulk_callback, dev);
-	urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+	exit:
+	up_read(&dev->io_rwsem);
+	return retval;
+}
 
-	retval = usb_submit_urb(urb, GFP_KERNEL);
+/* Called with no lock held, draining may have to wait for the pipeline */
+static int device_set_coalesce(struct arduino *dev, u32 usecs) {
+	WRITE_ONCE(dev->coalesce_ns, (u64)usecs * NSEC_PER_USEC);
+	/* leaving coalescing mode must not strand buffered bytes */
+	if (!usecs)
+		return device_coalesce_drain(dev, NULL);
+	return 0;
+}
+
+/*
+ * Rebuild the bulk in URBs and the ring, called with io_rwsem held
+ * exclusive and streaming stopped. Whatever can't be allocated keeps its
+ * old configuration.
+ */
+static int device_tune_rx(struct arduino *dev, size_t ring_size, unsigned int urbs, size_t urb_size) {
+	struct arduino_ring_ctrl *ctrl = dev->rx_ctrl;
+	unsigned char *ring = dev->rx_ring;
+	size_t size = dev->rx_size;
+	struct device_rx *pool = dev->rx_pool;
+	unsigned int count = dev->rx_count;
+	unsigned long head, tail, pos;
+	size_t from, to, chunk;
+	int retval;
+
+	if (urbs != dev->rx_count || urb_size != dev->bulk_in_size) {
+		dev->rx_pool = NULL;
+		retval = device_rx_pool_alloc(dev, urbs, urb_size);
+		/* put the old pool back in dev, to free it or to keep it */
+		swap(dev->rx_pool, pool);
+		swap(dev->rx_count, count);
+		swap(dev->bulk_in_size, urb_size);
+		if (retval)
+			return retval;
+		device_rx_pool_free(dev);
+		dev->rx_pool = pool;
+		dev->rx_count = count;
+		dev->bulk_in_size = urb_size;
+	}
+
+	if (ring_size == dev->rx_size)
+		return 0;
+	head = dev->rx_head;
+	tail = head - min_t(unsigned long, head, size);
+	retval = device_ring_alloc(dev, ring_size);
 	if (retval) {
-		printk(KERN_INFO "arduino: %s - failed submitting write usb, error %d", __FUNCTION__, retval);
-		goto error;
+		dev->rx_ctrl = ctrl;
+		dev->rx_ring = ring;
+		dev->rx_size = size;
+		return retval;
 	}
 
-	printk(KERN_INFO "arduino: successful write");
-	usb_free_urb(urb);
+	/* keep the newest bytes that fit, readers further behind see an overrun */
+	if (head - tail > dev->rx_size)
+		tail = head - dev->rx_size;
+	for (pos = tail; pos != head; pos += chunk) {
+		from = pos & (size - 1);
+		to = pos & (dev->rx_size - 1);
+		chunk = min_t(size_t, head - pos, min(size - from, dev->rx_size - to));
+		memcpy(dev->rx_ring + to, ring + from, chunk);
+	}
+	dev->rx_ctrl->head = head;
+	dev->rx_ctrl->claim = head;
+	vfree(ctrl);
+	return 0;
+}
+
+/* Resize the write pool once every write in flight is done, called with io_rwsem held exclusive */
+static int device_tune_tx(struct arduino *dev, unsigned int urbs) {
+	struct device_tx *pool;
+	unsigned long *busy;
+	unsigned int count;
+	int retval;
+
+	/* coalesce_buf is not part of the pool, its bytes wait for the new one */
+	mutex_lock(&dev->coalesce_mutex);
+	device_draw_down(dev);
+
+	pool = dev->tx_pool;
+	busy = dev->tx_busy;
+	count = dev->tx_count;
+	dev->tx_pool = NULL;
+	dev->tx_busy = NULL;
+	retval = device_tx_pool_alloc(dev, urbs);
+	swap(dev->tx_pool, pool);
+	swap(dev->tx_busy, busy);
+	swap(dev->tx_count, count);
+	if (retval)
+		goto exit;
+	device_tx_pool_free(dev);
+	dev->tx_pool = pool;
+	dev->tx_busy = busy;
+	dev->tx_count = count;
+	/* writers waiting for an entry of the old pool retry on this one */
+	atomic_inc(&dev->tx_released);
+	wake_up(&dev->tx_wait);
 
 	exit:
-	return count;
+	mutex_unlock(&dev->coalesce_mutex);
+	return retval;
+}
 
-	error:
-	usb_free_coherent(dev->udev, count, buf, urb->transfer_dma);
-	usb_free_urb(urb);
-	kfree(buf);
+/* Called with io_rwsem held */
+static void device_get_tuning(struct arduino *dev, struct arduino_tuning *t) {
+	t->rx_ring_size = dev->rx_size;
+	t->rx_urbs = dev->rx_count;
+	t->rx_urb_size = dev->bulk_in_size;
+	t->tx_urbs = dev->tx_count;
+	t->read_timeout_ms = jiffies_to_msecs(READ_ONCE(dev->read_timeout));
+	t->coalesce_us = div_u64(READ_ONCE(dev->coalesce_ns), NSEC_PER_USEC);
+}
+
+/*
+ * Apply the fields of t named in t->mask. Rebuilding the pools shuts out
+ * every other I/O call through io_rwsem, readers waiting for data don't
+ * hold it and go on waiting on the new ring.
+ */
+static int device_tune(struct arduino *dev, const struct arduino_tuning *t) {
+	size_t ring_size = 0, urb_size = 0;
+	unsigned int rx_urbs, tx_urbs;
+	int retval = 0;
+
+	if (t->mask & ~(ARDUINO_TUNE_RX_RING_SIZE | ARDUINO_TUNE_RX_URBS | ARDUINO_TUNE_RX_URB_SIZE |
+	ARDUINO_TUNE_TX_URBS | ARDUINO_TUNE_READ_TIMEOUT | ARDUINO_TUNE_COALESCE))
+		return -EINVAL;
+	if ((t->mask & ARDUINO_TUNE_RX_RING_SIZE) && (!t->rx_ring_size || t->rx_ring_size > ARDUINO_RX_RING_MAX))
+		return -EINVAL;
+	if ((t->mask & ARDUINO_TUNE_RX_URBS) && (!t->rx_urbs || t->rx_urbs > ARDUINO_URBS_MAX))
+		return -EINVAL;
+	if ((t->mask & ARDUINO_TUNE_RX_URB_SIZE) && (!t->rx_urb_size || t->rx_urb_size > ARDUINO_URB_SIZE_MAX))
+		return -EINVAL;
+	if ((t->mask & ARDUINO_TUNE_TX_URBS) && (!t->tx_urbs || t->tx_urbs > ARDUINO_URBS_MAX))
+		return -EINVAL;
+	if ((t->mask & ARDUINO_TUNE_READ_TIMEOUT) && (!t->read_timeout_ms || t->read_timeout_ms > ARDUINO_READ_TIMEOUT_MAX_MS))
+		return -EINVAL;
+	if ((t->mask & ARDUINO_TUNE_COALESCE) && t->coalesce_us > ARDUINO_COALESCE_MAX_US)
+		return -EINVAL;
+
+	if (down_write_killable(&dev->io_rwsem))
+		return -EINTR;
+	if (!dev->interface) {
+		retval = -ENODEV;
+		goto exit;
+	}
+
+	/* the ring stays a power of two pages, the URBs whole packets */
+	ring_size = t->mask & ARDUINO_TUNE_RX_RING_SIZE ?
+	roundup_pow_of_two(DIV_ROUND_UP(t->rx_ring_size, PAGE_SIZE)) * PAGE_SIZE : dev->rx_size;
+	urb_size = t->mask & ARDUINO_TUNE_RX_URB_SIZE ?
+	max(rounddown((size_t)t->rx_urb_size, dev->bulk_in_packet), dev->bulk_in_packet) : dev->bulk_in_size;
+	rx_urbs = t->mask & ARDUINO_TUNE_RX_URBS ? t->rx_urbs : dev->rx_count;
+	tx_urbs = t->mask & ARDUINO_TUNE_TX_URBS ? t->tx_urbs : dev->tx_count;
+
+	/* a transfer bigger than the ring would overwrite itself, and index payloads already gone */
+	if (urb_size > ring_size) {
+		retval = -EINVAL;
+		goto exit;
+	}
+	if (ring_size != dev->rx_size && atomic_read(&dev->rx_mapped)) {
+		retval = -EBUSY;
+		goto exit;
+	}
+	if (ring_size != dev->rx_size || rx_urbs != dev->rx_count || urb_size != dev->bulk_in_size) {
+		device_rx_stop(dev);
+		retval = device_tune_rx(dev, ring_size, rx_urbs, urb_size);
+		if (device_rx_start(dev) && !retval)
+			retval = -EIO;
+		if (retval)
+			goto exit;
+	}
+	if (tx_urbs != dev->tx_count) {
+		retval = device_tune_tx(dev, tx_urbs);
+		if (retval)
+			goto exit;
+	}
+
+	if (t->mask & ARDUINO_TUNE_READ_TIMEOUT)
+		WRITE_ONCE(dev->read_timeout, msecs_to_jiffies(t->read_timeout_ms));
+
+	exit:
+	up_write(&dev->io_rwsem);
+	/* coalescing needs no rebuild, and leaving it may have to wait for the pipeline */
+	if (!retval && (t->mask & ARDUINO_TUNE_COALESCE))
+		retval = device_set_coalesce(dev, t->coalesce_us);
 	return retval;
 }
 
+static long device_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
+	struct device_file *df = (struct device_file *) file->private_data;
+	struct arduino *dev = df->dev;
+	u32 __user *argp = (u32 __user *) arg;
+	struct arduino_tuning tuning;
+	struct device_index *idx;
+	u64 lost;
+	u32 usecs, mode;
+	int retval;
+
+	switch (cmd) {
+	case ARDUINO_IOC_SET_COALESCE:
+		if (get_user(usecs, argp))
+			return -EFAULT;
+		if (usecs > ARDUINO_COALESCE_MAX_US)
+			return -EINVAL;
+		if (!READ_ONCE(dev->interface))
+			return -ENODEV;
+		return device_set_coalesce(dev, usecs);
+	case ARDUINO_IOC_GET_COALESCE:
+		usecs = div_u64(READ_ONCE(dev->coalesce_ns), NSEC_PER_USEC);
+		return put_user(usecs, argp);
+	case ARDUINO_IOC_SET_TUNING:
+		if (copy_from_user(&tuning, (void __user *) arg, sizeof(tuning)))
+			return -EFAULT;
+		retval = device_tune(dev, &tuning);
+		if (retval)
+			return retval;
+		fallthrough;
+	case ARDUINO_IOC_GET_TUNING:
+		memset(&tuning, 0, sizeof(tuning));
+		down_read(&dev->io_rwsem);
+		device_get_tuning(dev, &tuning);
+		up_read(&dev->io_rwsem);
+		if (copy_to_user((void __user *) arg, &tuning, sizeof(tuning)))
+			return -EFAULT;
+		return 0;
+	case ARDUINO_IOC_GET_OVERRUNS:
+		retval = device_rx_lock(df, false);
+		if (retval)
+			return retval;
+		idx = device_file_index(df);
+		if (idx) {
+			spin_lock_irq(&dev->rx_lock);
+			device_file_rec_catch_up(df, idx);
+			spin_unlock_irq(&dev->rx_lock);
+		} else {
+			device_file_catch_up(df, READ_ONCE(dev->rx_claim));
+		}
+		lost = df->lost;
+		WRITE_ONCE(df->lost, 0);
+		device_rx_unlock(df);
+		return put_user(lost, (u64 __user *) arg);
+	case ARDUINO_IOC_SET_READ_MODE:
+		if (get_user(mode, argp))
+			return -EFAULT;
+		if (mode != ARDUINO_READ_BYTES && mode != ARDUINO_READ_RECORDS && mode != ARDUINO_READ_FRAMES)
+			return -EINVAL;
+		retval = device_rx_lock(df, false);
+		if (retval)
+			return retval;
+		/* the cursors went stale while the mode didn't use them */
+		WRITE_ONCE(df->mode, mode);
+		WRITE_ONCE(df->tail, smp_load_acquire(&dev->rx_head));
+		idx = device_file_index(df);
+		if (idx)
+			WRITE_ONCE(df->rec_tail, smp_load_acquire(&idx->head));
+		WRITE_ONCE(df->lost, 0);
+		device_rx_unlock(df);
+		return 0;
+	case ARDUINO_IOC_GET_READ_MODE:
+		return put_user(READ_ONCE(df->mode), argp);
+	default:
+		return -ENOTTY;
+	}
+}
+
+/* Wait for the writes in flight, give up on them after a second */
+static void device_draw_down(struct arduino *dev) {
+	if (!usb_wait_anchor_empty_timeout(&dev->submitted, 1000))
+		usb_kill_anchored_urbs(&dev->submitted);
+}
+
 /*
 	******USB OPERATIONS********
 */
@@ -227,7 +1964,7 @@ static int device_probe(struct usb_interface *interface, const struct usb_device
 	struct arduino *dev = NULL;
 	struct usb_host_interface *iface_desc;
 	struct usb_endpoint_descriptor *endpoint;
-	size_t buffer_size;
+	unsigned int tx_urbs;
 	int i;
 	int retval = -ENOMEM;
 
@@ -238,10 +1975,25 @@ static int device_probe(struct usb_interface *interface, const struct usb_device
 	}
 	memset(dev, 0x00, sizeof (*dev));
 	kref_init(&dev->kref);
+	spin_lock_init(&dev->rx_lock);
+	init_waitqueue_head(&dev->rx_wait);
+	init_rwsem(&dev->io_rwsem);
+	mutex_init(&dev->write_mutex);
+	dev->read_timeout = ARDUINO_READ_TIMEOUT;
+	init_usb_anchor(&dev->rx_submitted);
+	init_usb_anchor(&dev->rx_parked);
+	INIT_DELAYED_WORK(&dev->rx_retry, device_rx_retry);
+	init_usb_anchor(&dev->submitted);
+	init_waitqueue_head(&dev->tx_wait);
+	spin_lock_init(&dev->err_lock);
+	mutex_init(&dev->coalesce_mutex);
+	hrtimer_setup(&dev->coalesce_timer, device_coalesce_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	INIT_WORK(&dev->coalesce_work, device_coalesce_work);
 
 	dev->udev = usb_get_dev(interface_to_usbdev(interface));
 	dev->interface = interface;
-    printk(KERN_INFO "arduino: New device connected device number %d \n",dev->udev->devnum);
+	dev->board = (const struct arduino_board *) id->driver_info;
+    printk(KERN_INFO "arduino: New %s connected device number %d \n",dev->board->name,dev->udev->devnum);
 	iface_desc = interface->cur_altsetting;
 	for (i = 0; i < iface_desc->desc.bNumEndpoints; ++i) {
 		endpoint = &iface_desc->endpoint[i].desc;
@@ -250,23 +2002,19 @@ static int device_probe(struct usb_interface *interface, const struct usb_device
 		(endpoint->bEndpointAddress & USB_DIR_IN) &&
 		((endpoint->bmAttributes & USB_ENDPOINT_XFERTYPE_MASK)
 		== USB_ENDPOINT_XFER_BULK)) {
-			buffer_size = endpoint->wMaxPacketSize;
-			dev->bulk_in_size = buffer_size;
+			dev->bulk_in_packet = usb_endpoint_maxp(endpoint);
 			dev->bulk_in_endpointAddr = endpoint->bEndpointAddress;
-			dev->bulk_in_buffer = kmalloc(buffer_size, GFP_KERNEL);
-			if (!dev->bulk_in_buffer) {
-				printk(KERN_INFO "arduino: %d Could not allocate bulk_in_buffer\n",dev->udev->devnum);
-				goto error;
-			}
 		}
 
 		if (!dev->bulk_out_endpointAddr &&!(endpoint->bEndpointAddress & USB_DIR_IN) &&((endpoint->bmAttributes & USB_ENDPOINT_XFERTYPE_MASK)
 		== USB_ENDPOINT_XFER_BULK)) {
+			dev->bulk_out_size = usb_endpoint_maxp(endpoint);
 			dev->bulk_out_endpointAddr = endpoint->bEndpointAddress;
 		}
 	}
 	if (!(dev->bulk_in_endpointAddr && dev->bulk_out_endpointAddr)) {
 		printk(KERN_INFO "arduino: %d Could not find both bulk-in and bulk-out endpoints\n",dev->udev->devnum);
+		retval = -ENODEV;
 		goto error;
 	}
     else {
@@ -274,6 +2022,42 @@ static int device_probe(struct usb_interface *interface, const struct usb_device
 		
     }
 
+	if (device_ring_alloc(dev, dev->board->rx_ring_pages * PAGE_SIZE)) {
+		printk(KERN_INFO "arduino: %d Could not allocate rx_ring\n",dev->udev->devnum);
+		goto error;
+	}
+	dev->rx_recs.size = ARDUINO_RX_RECORDS;
+	dev->rx_recs.slot = kcalloc(dev->rx_recs.size, sizeof(*dev->rx_recs.slot), GFP_KERNEL);
+	dev->rx_frames.size = ARDUINO_RX_FRAMES;
+	dev->rx_frames.slot = kcalloc(dev->rx_frames.size, sizeof(*dev->rx_frames.slot), GFP_KERNEL);
+	if (!dev->rx_recs.slot || !dev->rx_frames.slot)
+		goto error;
+
+	if (device_rx_pool_alloc(dev, dev->board->rx_urbs,
+	max(rounddown((size_t)dev->board->rx_urb_size, dev->bulk_in_packet), dev->bulk_in_packet)))
+		goto error;
+
+	dev->tx_buf_size = max(rounddown((size_t)dev->board->tx_urb_size, dev->bulk_out_size), dev->bulk_out_size);
+	tx_urbs = writes_in_flight ? writes_in_flight : dev->board->tx_urbs;
+	if (tx_urbs > ARDUINO_URBS_MAX) {
+		printk(KERN_INFO "arduino: %d writes_in_flight %u clamped to %u\n",dev->udev->devnum, tx_urbs, ARDUINO_URBS_MAX);
+		tx_urbs = ARDUINO_URBS_MAX;
+	}
+	if (device_tx_pool_alloc(dev, tx_urbs))
+		goto error;
+
+	dev->coalesce_buf = kmalloc(dev->bulk_out_size, GFP_KERNEL);
+	if (!dev->coalesce_buf)
+		goto error;
+
+	if (dev->board->line_state) {
+		retval = device_comm_claim(dev, iface_desc->desc.bInterfaceNumber);
+		if (retval) {
+			printk(KERN_INFO "arduino: %d Could not claim the comm interface, error %d\n",dev->udev->devnum, retval);
+			goto error;
+		}
+	}
+
 	usb_set_intfdata(interface, dev);
 
 	retval = usb_register_dev(interface, &device_class);
@@ -283,27 +2067,84 @@ static int device_probe(struct usb_interface *interface, const struct usb_device
 		goto error;
 	}
 
+	dev->minor = interface->minor;
+	if (device_add_group(interface->usb_dev, &device_stats_group))
+		printk(KERN_INFO "arduino: %d Could not create the stats attributes\n", dev->udev->devnum);
+	dev->debugfs = debugfs_create_file(dev_name(interface->usb_dev), 0444, debugfs_root,
+	dev, &device_stats_fops);
+
+	/* start streaming right away so nothing the board sends before the first read() is lost */
+	retval = device_rx_start(dev);
+	if (retval) {
+		debugfs_remove(dev->debugfs);
+		device_remove_group(interface->usb_dev, &device_stats_group);
+		usb_deregister_dev(interface, &device_class);
+		usb_set_intfdata(interface, NULL);
+		goto error;
+	}
+
+	/* without DTR the sketch never sees the port open, but the board can still be written to and retried */
+	if (dev->comm) {
+		retval = device_comm_open(dev);
+		if (retval)
+			printk(KERN_INFO "arduino: %d Could not raise DTR, error %d\n", dev->udev->devnum, retval);
+	}
+
 	printk(KERN_INFO "arduino: %d device now attached to /dev/ardu%d\n", dev->udev->devnum, interface->minor);
 	return 0;
 
 	error:
 	printk(KERN_INFO "arduino: %d Exiting from error\n", dev->udev->devnum);
-	if (dev)    kref_put(&dev->kref, device_delete);
+	if (dev) {
+		device_comm_release(dev);
+		kref_put(&dev->kref, device_delete);
+	}
 	return retval;
 }
 /* Called when a process closes our device */
 static void device_disconnect(struct usb_interface *interface) {
 	struct arduino *dev;
 	int minor = interface->minor;
-
-	mutex_lock(&fs_mutex);
+	bool pending;
 
 	dev = usb_get_intfdata(interface);
+	/* the comm interface probe claimed, released along with the data interface */
+	if (!dev)
+		return;
+
+	/* the attributes look the device up through the interface, drop them first */
+	debugfs_remove(dev->debugfs);
+	device_remove_group(interface->usb_dev, &device_stats_group);
 	usb_set_intfdata(interface, NULL);
 
+	/* usbcore keeps open() out while the minor goes away, no lock of ours needed */
 	usb_deregister_dev(interface, &device_class);
 
-	mutex_unlock(&fs_mutex);
+	/*
+	 * Writers holding io_rwsem may wait for a free URB, kill the ones in
+	 * flight so they get one. Once io_rwsem is ours no call is left on
+	 * the board and later ones find interface cleared.
+	 */
+	usb_kill_anchored_urbs(&dev->submitted);
+	down_write(&dev->io_rwsem);
+	WRITE_ONCE(dev->interface, NULL);
+	device_rx_stop(dev);
+	up_write(&dev->io_rwsem);
+
+	/*
+	 * Only the coalescing deadline can still submit. A work that ran
+	 * before interface was cleared may have re-armed the timer, later
+	 * ones bail out, so this ends once neither was pending.
+	 */
+	do {
+		pending = hrtimer_cancel(&dev->coalesce_timer);
+		pending |= cancel_work_sync(&dev->coalesce_work);
+	} while (pending);
+	device_draw_down(dev);
+	device_comm_release(dev);
+
+	wake_up(&dev->rx_wait);
+	wake_up(&dev->tx_wait);
 
 	kref_put(&dev->kref, device_delete);
 
@@ -312,9 +2153,14 @@ static void device_disconnect(struct usb_interface *interface) {
 static int __init device_init(void) {
 	int res;
 
+	debugfs_root = debugfs_create_dir("arduino", NULL);
+
 	res = usb_register(&arduino);
-	if (res )
+	if (res ) {
 		printk(KERN_INFO "arduino: usb_register failed. Error number %d\n", res);
+		debugfs_remove_recursive(debugfs_root);
+		return res;
+	}
 
 	printk(KERN_INFO "arduino: driver registered\n");
 	return res;
@@ -323,6 +2169,7 @@ static void __exit device_exit(void) {
  /* Remember — we have to clean up after ourselves. Unregister the character device. */
 	printk(KERN_INFO "arduino: driver deregistered\n");
 	usb_deregister(&arduino);
+	debugfs_remove_recursive(debugfs_root);
 }
 /* Register module functions */
 module_init(device_init);
@@ -0,0 +1,126 @@
+/*
+ * ioctl interface of the arduino driver, shared by the kernel module and
+ * the userspace library.
+ */
+#ifndef _ARDUINO_IOCTL_H
+#define _ARDUINO_IOCTL_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define ARDUINO_IOC_MAGIC	'A'
+
+/*
+ * Write coalescing, in microseconds. While non zero, writes to the device
+ * are accumulated and sent once a full bulk packet is buffered, once the
+ * deadline since the first buffered byte expires, or on fsync()/close().
+ * 0 (the default) sends every write() as its own transfer. The setting
+ * applies to the device, not to the file descriptor it is made through.
+ */
+#define ARDUINO_IOC_SET_COALESCE	_IOW(ARDUINO_IOC_MAGIC, 1, __u32)
+#define ARDUINO_IOC_GET_COALESCE	_IOR(ARDUINO_IOC_MAGIC, 2, __u32)
+
+#define ARDUINO_COALESCE_MAX_US	1000000	// longest accepted coalescing deadline
+
+/*
+ * Buffer sizes, URB depth and timeouts of a device. GET fills in every
+ * field, SET applies the fields named in mask and then returns the
+ * configuration in effect, with sizes rounded the way the driver needs
+ * them. Changing rx_ring_size keeps the unread data that fits and fails
+ * with EBUSY while the ring is mapped. After rounding, rx_urb_size
+ * can't exceed rx_ring_size, EINVAL otherwise. Like coalescing, the
+ * settings belong to the device and last until it is unplugged.
+ */
+struct arduino_tuning {
+	__u32	mask;			// ARDUINO_TUNE_* fields SET applies
+	__u32	rx_ring_size;		// bytes, rounded up to a power of two pages
+	__u32	rx_urbs;		// bulk in URBs kept in flight
+	__u32	rx_urb_size;		// bytes per bulk in URB, rounded down to whole packets
+	__u32	tx_urbs;		// bulk out URBs, write() blocks once all are in flight
+	__u32	read_timeout_ms;	// how long a blocking read() waits for data
+	__u32	coalesce_us;		// as ARDUINO_IOC_SET_COALESCE
+};
+
+#define ARDUINO_TUNE_RX_RING_SIZE	(1 << 0)
+#define ARDUINO_TUNE_RX_URBS		(1 << 1)
+#define ARDUINO_TUNE_RX_URB_SIZE	(1 << 2)
+#define ARDUINO_TUNE_TX_URBS		(1 << 3)
+#define ARDUINO_TUNE_READ_TIMEOUT	(1 << 4)
+#define ARDUINO_TUNE_COALESCE		(1 << 5)
+
+#define ARDUINO_RX_RING_MAX		(16 << 20)	// largest rx_ring_size
+#define ARDUINO_URBS_MAX		64		// most rx_urbs or tx_urbs
+#define ARDUINO_URB_SIZE_MAX		(64 << 10)	// largest rx_urb_size
+#define ARDUINO_READ_TIMEOUT_MAX_MS	3600000		// longest read_timeout_ms
+
+#define ARDUINO_IOC_GET_TUNING	_IOR(ARDUINO_IOC_MAGIC, 3, struct arduino_tuning)
+#define ARDUINO_IOC_SET_TUNING	_IOWR(ARDUINO_IOC_MAGIC, 4, struct arduino_tuning)
+
+/*
+ * Every open file reads the whole stream from the board. A file that
+ * falls more than the ring size behind loses the oldest bytes, poll()
+ * then reports EPOLLPRI. This returns how many bytes the file lost since
+ * the last call and resets the count.
+ */
+#define ARDUINO_IOC_GET_OVERRUNS	_IOR(ARDUINO_IOC_MAGIC, 5, __u64)
+
+/*
+ * What read() returns, chosen per open file. ARDUINO_READ_BYTES (the
+ * default) is the raw stream. ARDUINO_READ_RECORDS returns one
+ * struct arduino_record per completed bulk in transfer, each followed by
+ * length bytes of payload. ARDUINO_READ_FRAMES returns one message per
+ * read(): a line including its '\n', or a binary frame from
+ * ARDUINO_FRAME_SOF to its check byte, see firmware/SerialEvent/finger_proto.h.
+ * Lines longer than ARDUINO_FRAME_MAX come in pieces of that size.
+ * Record and frame mode reads only return whole messages and fail with
+ * EMSGSIZE when the next one doesn't fit in the buffer. Switching modes
+ * starts the file at the newest data and clears its overrun count,
+ * which counts records or frames rather than bytes in those modes.
+ */
+#define ARDUINO_READ_BYTES	0
+#define ARDUINO_READ_RECORDS	1
+#define ARDUINO_READ_FRAMES	2
+
+#define ARDUINO_FRAME_SOF	0xA5	// starts a binary frame, FINGER_SOF
+#define ARDUINO_FRAME_MAX	512	// longest frame mode message
+
+#define ARDUINO_IOC_SET_READ_MODE	_IOW(ARDUINO_IOC_MAGIC, 6, __u32)
+#define ARDUINO_IOC_GET_READ_MODE	_IOR(ARDUINO_IOC_MAGIC, 7, __u32)
+
+struct arduino_record {
+	__u64	timestamp_ns;		// ktime_get_ns() when the transfer completed
+	__u64	seq;			// transfers since the device was bound, a gap means lost records, wraps at 2^32 on 32-bit kernels
+	__u32	length;			// payload bytes following this header
+	__s32	status;			// URB status, failed transfers carry no payload
+};
+
+/*
+ * mmap() of the device exposes the receive ring: this control page at
+ * offset 0, then size bytes of data at data_offset. head and claim count
+ * bytes since the device was bound, the data of byte n lives at
+ * data[n & (size - 1)] until byte n + size arrives. The driver never
+ * waits for consumers, each keeps its own cursor:
+ *
+ *  1. load head with acquire semantics, bytes up to it are readable
+ *  2. use the data at the cursor
+ *  3. load claim after the data (acquire fence). Once claim - cursor
+ *     exceeds size the driver overwrote what was used and it has to be
+ *     dropped; the oldest intact byte is then claim - size.
+ *
+ * The driver raises claim before overwriting data and head after writing
+ * it, so claim >= head.
+ *
+ * The driver counts in unsigned long and stores head and claim widened
+ * to 64 bits. On a 32-bit kernel they wrap at 2^32 and their high word
+ * stays 0, so a 64-bit load can't see a torn value, but distances like
+ * claim - cursor have to be taken modulo 2^32 there: compute them as
+ * unsigned long, as finger_rx_peek() does.
+ */
+struct arduino_ring_ctrl {
+	__u64	head;
+	__u64	claim;
+	__u32	size;
+	__u32	data_offset;
+};
+
+#endif
@@ -0,0 +1,87 @@
+/*
+ * Tracepoints of the arduino driver, enable them with
+ *   echo 1 > /sys/kernel/tracing/events/arduino/enable
+ * or record them with perf record -e 'arduino:*'.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM arduino
+
+#if !defined(_ARDUINO_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _ARDUINO_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(arduino_open,
+	TP_PROTO(int minor, int ret),
+	TP_ARGS(minor, ret),
+	TP_STRUCT__entry(
+		__field(int,	minor)
+		__field(int,	ret)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->ret = ret;
+	),
+	TP_printk("ardu%d ret=%d", __entry->minor, __entry->ret)
+);
+
+/* One read() or write() call, duration covers waiting for data or for a free URB */
+DECLARE_EVENT_CLASS(arduino_io,
+	TP_PROTO(int minor, size_t count, ssize_t ret, s64 duration_ns),
+	TP_ARGS(minor, count, ret, duration_ns),
+	TP_STRUCT__entry(
+		__field(int,		minor)
+		__field(size_t,		count)
+		__field(ssize_t,	ret)
+		__field(s64,		duration_ns)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->count = count;
+		__entry->ret = ret;
+		__entry->duration_ns = duration_ns;
+	),
+	TP_printk("ardu%d count=%zu ret=%zd duration=%lldns",
+		__entry->minor, __entry->count, __entry->ret, __entry->duration_ns)
+);
+
+DEFINE_EVENT(arduino_io, arduino_read,
+	TP_PROTO(int minor, size_t count, ssize_t ret, s64 duration_ns),
+	TP_ARGS(minor, count, ret, duration_ns)
+);
+
+DEFINE_EVENT(arduino_io, arduino_write,
+	TP_PROTO(int minor, size_t count, ssize_t ret, s64 duration_ns),
+	TP_ARGS(minor, count, ret, duration_ns)
+);
+
+/* A bulk URB handed back by the host controller, latency is submit to completion */
+TRACE_EVENT(arduino_urb_complete,
+	TP_PROTO(int minor, bool in, int status, u32 length, s64 latency_ns),
+	TP_ARGS(minor, in, status, length, latency_ns),
+	TP_STRUCT__entry(
+		__field(int,	minor)
+		__field(bool,	in)
+		__field(int,	status)
+		__field(u32,	length)
+		__field(s64,	latency_ns)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->in = in;
+		__entry->status = status;
+		__entry->length = length;
+		__entry->latency_ns = latency_ns;
+	),
+	TP_printk("ardu%d %s status=%d length=%u latency=%lldns",
+		__entry->minor, __entry->in ? "in" : "out", __entry->status,
+		__entry->length, __entry->latency_ns)
+);
+
+#endif /* _ARDUINO_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE arduino_trace
+#include <trace/define_trace.h>
@@ -1,19 +1,40 @@
-String inputString = "";         // a String to hold incoming data
+#include "finger_fw.h"
+
+struct finger_fw fw;
 
 void setup() {
   // initialize serial:
   Serial.begin(115200);
    pinMode(LED_BUILTIN, OUTPUT);
+  finger_fw_init(&fw);
 }
 
+// never blocks: queue what arrived, then parse and dispatch a bounded amount of it
 void loop() {
-}
-void serialEvent() {
-  while (Serial.available()) {
-    char inChar = (char)Serial.read();
-    Serial.println(inChar);
-    digitalWrite(LED_BUILTIN, HIGH);
-    delay(200);
-    digitalWrite(LED_BUILTIN, LOW);
+  while (Serial.available() && finger_fw_push(&fw, (uint8_t)Serial.peek())) {
+    Serial.read();
   }
+  finger_fw_poll(&fw, millis());
+}
+
+extern "C" {
+
+// the finger hardware is driven from these hooks
+void finger_hw_move(int16_t x, int16_t y) {
+}
+
+void finger_hw_pick(void) {
+}
+
+void finger_hw_drop(void) {
+}
+
+void finger_hw_led(uint8_t on) {
+  digitalWrite(LED_BUILTIN, on ? HIGH : LOW);
+}
+
+void finger_hw_send(const uint8_t *buf, uint8_t len) {
+  Serial.write(buf, len);
+}
+
 }
@@ -0,0 +1,76 @@
+#include <string.h>
+#include "finger_fw.h"
+
+void finger_fw_init(struct finger_fw *fw) {
+	memset(fw, 0, sizeof(*fw));
+	finger_hw_led(0);
+}
+
+uint8_t finger_fw_push(struct finger_fw *fw, uint8_t c) {
+	if ((uint8_t)(fw->rx_head - fw->rx_tail) == FINGER_FW_RX)
+		return 0;
+	fw->rx[fw->rx_head++ & (FINGER_FW_RX - 1)] = c;
+	return 1;
+}
+
+// Answer in the form the command arrived in, the host library completes commands on it
+static void finger_fw_ack(uint8_t op, uint8_t binary) {
+	uint8_t frame[FINGER_FRAME_MAX];
+
+	if (binary) {
+		finger_hw_send(frame, finger_frame(frame, op, NULL, 0));
+	} else {
+		frame[0] = op;
+		frame[1] = '\n';
+		finger_hw_send(frame, 2);
+	}
+}
+
+static void finger_fw_dispatch(struct finger_fw *fw, const struct finger_msg *msg) {
+	switch (msg->op) {
+	case FINGER_OP_MOVE:
+		fw->x = msg->x;
+		fw->y = msg->y;
+		finger_hw_move(msg->x, msg->y);
+		break;
+	case FINGER_OP_PICK:
+		fw->holding = 1;
+		finger_hw_pick();
+		break;
+	case FINGER_OP_DROP:
+		fw->holding = 0;
+		finger_hw_drop();
+		break;
+	default:
+		// unknown commands are acknowledged too, so the host never stalls
+		break;
+	}
+	fw->commands++;
+	finger_fw_ack(FINGER_OP_ACK, msg->binary);
+}
+
+void finger_fw_poll(struct finger_fw *fw, uint32_t now) {
+	struct finger_msg msg;
+	uint8_t n;
+
+	for (n = 0; n < FINGER_FW_POLL_BYTES && fw->rx_tail != fw->rx_head; n++) {
+		if (!finger_parse(&fw->parser, fw->rx[fw->rx_tail++ & (FINGER_FW_RX - 1)]))
+			continue;
+		// a malformed command still gets its answer, the host must not wait on it
+		if (!finger_decode(&fw->parser, &msg)) {
+			finger_fw_ack(FINGER_OP_ERR, fw->parser.binary);
+			continue;
+		}
+		finger_fw_dispatch(fw, &msg);
+		if (!fw->led)
+			finger_hw_led(1);
+		fw->led = 1;
+		fw->led_off = now + FINGER_FW_LED_MS;
+	}
+
+	// signed difference so millis() wrapping around is harmless
+	if (fw->led && (int32_t)(now - fw->led_off) >= 0) {
+		fw->led = 0;
+		finger_hw_led(0);
+	}
+}
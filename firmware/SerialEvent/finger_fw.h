@@ -0,0 +1,52 @@
+/*
+ * Command loop of the finger firmware, kept free of Arduino calls so the
+ * same code runs in the host simulator under firmware/sim.
+ *
+ * Received bytes are queued with finger_fw_push(), finger_fw_poll() parses
+ * and dispatches them from loop() without ever blocking. The board side
+ * provides the finger_hw_* hooks.
+ */
+#ifndef _FINGER_FW_H
+#define _FINGER_FW_H
+
+#include <stdint.h>
+#include "finger_proto.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FINGER_FW_RX		128	// receive ring, a power of two
+#define FINGER_FW_POLL_BYTES	32	// bytes parsed per finger_fw_poll()
+#define FINGER_FW_LED_MS	50	// LED stays on this long after a command
+
+struct finger_fw {
+	uint8_t rx[FINGER_FW_RX];
+	uint8_t rx_head;		// written by finger_fw_push()
+	uint8_t rx_tail;		// read by finger_fw_poll()
+	struct finger_parser parser;
+	int16_t x;			// last position moved to
+	int16_t y;
+	uint8_t holding;		// picked and not dropped yet
+	uint8_t led;
+	uint32_t led_off;		// millis() when the LED goes off
+	uint32_t commands;		// dispatched so far
+};
+
+// Board hooks
+void finger_hw_move(int16_t x, int16_t y);
+void finger_hw_pick(void);
+void finger_hw_drop(void);
+void finger_hw_led(uint8_t on);
+void finger_hw_send(const uint8_t *buf, uint8_t len);
+
+void finger_fw_init(struct finger_fw *fw);
+// Returns 0 when the ring is full, leave the byte in the serial buffer then
+uint8_t finger_fw_push(struct finger_fw *fw, uint8_t c);
+void finger_fw_poll(struct finger_fw *fw, uint32_t now);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,206 @@
+/*
+ * Command protocol between the finger library and the SerialEvent sketch.
+ * Both sides include this file, keep it C and C++ compatible.
+ *
+ * ASCII messages are one line: the opcode character, comma separated
+ * decimal operands and '\n', e.g. "m120,-40\n".
+ *
+ * Binary messages are frames:
+ *
+ *   FINGER_SOF | len | op | operands | crc
+ *
+ * len counts op and operands, operands are fixed width little endian and
+ * crc is a CRC-8 (polynomial 0x07) over len, op and operands. FINGER_SOF
+ * is not printable, so both forms can share one stream.
+ *
+ * The board answers every command with FINGER_OP_ACK, in the form the
+ * command arrived in. A message that completed but can't be decoded, a
+ * frame of the wrong length or an ASCII line with missing or out of range
+ * operands, is answered with FINGER_OP_ERR instead. Frames failing the
+ * CRC get no answer, not even their length can be trusted.
+ */
+#ifndef _FINGER_PROTO_H
+#define _FINGER_PROTO_H
+
+#include <stdint.h>
+
+#define FINGER_SOF		0xA5
+#define FINGER_OP_MOVE		'm'	// int16 x, int16 y
+#define FINGER_OP_PICK		'p'
+#define FINGER_OP_DROP		'd'
+#define FINGER_OP_ACK		'k'	// board to host
+#define FINGER_OP_ERR		'e'	// board to host, the command was malformed and ignored
+
+#define FINGER_PAYLOAD_MAX	32	// op and operands, or an ASCII line
+#define FINGER_FRAME_MAX	(FINGER_PAYLOAD_MAX + 3)
+
+static inline uint8_t finger_crc8(uint8_t crc, uint8_t byte) {
+	uint8_t i;
+
+	crc ^= byte;
+	for (i = 0; i < 8; i++)
+		crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x07) : (uint8_t)(crc << 1);
+	return crc;
+}
+
+/* Frame op and len operand bytes into buf, returns the frame length */
+static inline uint8_t finger_frame(uint8_t *buf, uint8_t op, const uint8_t *operands, uint8_t len) {
+	uint8_t crc, i;
+
+	buf[0] = FINGER_SOF;
+	buf[1] = len + 1;
+	buf[2] = op;
+	crc = finger_crc8(finger_crc8(0, buf[1]), op);
+	for (i = 0; i < len; i++) {
+		buf[3 + i] = operands[i];
+		crc = finger_crc8(crc, operands[i]);
+	}
+	buf[3 + len] = crc;
+	return len + 4;
+}
+
+enum finger_parse_state {
+	FINGER_PARSE_IDLE,
+	FINGER_PARSE_LINE,
+	FINGER_PARSE_SKIP_LINE,		// ASCII line too long, drop it
+	FINGER_PARSE_LEN,
+	FINGER_PARSE_BODY,
+	FINGER_PARSE_CRC,
+};
+
+/* Incremental parser, feed it one byte at a time with finger_parse() */
+struct finger_parser {
+	uint8_t state;
+	uint8_t len;			// expected payload bytes of a frame
+	uint8_t pos;			// payload bytes received
+	uint8_t crc;
+	uint8_t binary;			// the completed message was a frame
+	uint8_t buf[FINGER_PAYLOAD_MAX];
+};
+
+/* A decoded message */
+struct finger_msg {
+	uint8_t op;
+	uint8_t binary;
+	int16_t x;
+	int16_t y;
+};
+
+/*
+ * Constant time per byte. Returns 1 when c completes a message, which is
+ * then in buf[0..pos). Corrupt frames are dropped silently.
+ */
+static inline int finger_parse(struct finger_parser *p, uint8_t c) {
+	switch (p->state) {
+	case FINGER_PARSE_IDLE:
+		p->pos = 0;
+		if (c == FINGER_SOF) {
+			p->state = FINGER_PARSE_LEN;
+			return 0;
+		}
+		if (c == '\r' || c == '\n')
+			return 0;
+		p->state = FINGER_PARSE_LINE;
+		/* fall through */
+	case FINGER_PARSE_LINE:
+		if (c == '\r')
+			return 0;
+		if (c == '\n') {
+			p->state = FINGER_PARSE_IDLE;
+			p->binary = 0;
+			return 1;
+		}
+		if (p->pos == FINGER_PAYLOAD_MAX)
+			p->state = FINGER_PARSE_SKIP_LINE;
+		else
+			p->buf[p->pos++] = c;
+		return 0;
+	case FINGER_PARSE_SKIP_LINE:
+		if (c == '\n')
+			p->state = FINGER_PARSE_IDLE;
+		return 0;
+	case FINGER_PARSE_LEN:
+		if (c == 0 || c > FINGER_PAYLOAD_MAX) {
+			p->state = FINGER_PARSE_IDLE;
+			return 0;
+		}
+		p->len = c;
+		p->crc = finger_crc8(0, c);
+		p->state = FINGER_PARSE_BODY;
+		return 0;
+	case FINGER_PARSE_BODY:
+		p->buf[p->pos++] = c;
+		p->crc = finger_crc8(p->crc, c);
+		if (p->pos == p->len)
+			p->state = FINGER_PARSE_CRC;
+		return 0;
+	case FINGER_PARSE_CRC:
+		p->state = FINGER_PARSE_IDLE;
+		p->binary = 1;
+		return c == p->crc;
+	}
+	p->state = FINGER_PARSE_IDLE;
+	return 0;
+}
+
+static inline int16_t finger_get_le16(const uint8_t *buf) {
+	return (int16_t)(buf[0] | (buf[1] << 8));
+}
+
+static inline void finger_put_le16(uint8_t *buf, int16_t v) {
+	buf[0] = (uint8_t)v;
+	buf[1] = (uint8_t)((uint16_t)v >> 8);
+}
+
+/*
+ * Parse a decimal operand of an ASCII line into *v, advances *pos past it.
+ * Returns 0 without a digit or outside INT16_MIN..INT16_MAX.
+ */
+static inline int finger_get_dec(const uint8_t *buf, uint8_t len, uint8_t *pos, int16_t *v) {
+	uint32_t u = 0;
+	uint8_t neg = 0;
+	uint8_t start;
+
+	if (*pos < len && buf[*pos] == '-') {
+		neg = 1;
+		(*pos)++;
+	}
+	start = *pos;
+	while (*pos < len && buf[*pos] >= '0' && buf[*pos] <= '9') {
+		u = u * 10 + (buf[(*pos)++] - '0');
+		if (u > 32767u + neg)
+			return 0;
+	}
+	if (*pos == start)
+		return 0;
+	*v = neg ? (int16_t)(-(int32_t)u) : (int16_t)u;
+	return 1;
+}
+
+/* Decode the message finger_parse() just completed, returns 0 if malformed */
+static inline int finger_decode(const struct finger_parser *p, struct finger_msg *m) {
+	uint8_t pos = 1;
+
+	if (!p->pos)
+		return 0;
+	m->op = p->buf[0];
+	m->binary = p->binary;
+	m->x = 0;
+	m->y = 0;
+	if (m->op != FINGER_OP_MOVE)
+		return 1;
+	if (p->binary) {
+		if (p->pos != 5)
+			return 0;
+		m->x = finger_get_le16(p->buf + 1);
+		m->y = finger_get_le16(p->buf + 3);
+		return 1;
+	}
+	if (!finger_get_dec(p->buf, p->pos, &pos, &m->x) ||
+	    pos == p->pos || p->buf[pos++] != ',' ||
+	    !finger_get_dec(p->buf, p->pos, &pos, &m->y))
+		return 0;
+	return pos == p->pos;
+}
+
+#endif
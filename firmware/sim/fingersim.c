@@ -0,0 +1,157 @@
+/*
+ * Runs the firmware command loop of ../SerialEvent on the host.
+ * Commands are read from stdin and acknowledgements written to stdout,
+ * with -v every dispatched command is logged to stderr.
+ *
+ *   printf 'm10,20\np\n' | ./fingersim -v
+ *
+ * With -p the simulated board sits behind a pseudo terminal instead and
+ * path is made a symlink to it, so the library and its programs can talk
+ * to it like to a real board:
+ *
+ *   ./fingersim -p /tmp/ttyardu0 &
+ *   ../../library/main /tmp/ttyardu0
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+
+#include "finger_fw.h"
+
+static int verbose;
+static int in_fd = STDIN_FILENO;
+static int out_fd = STDOUT_FILENO;
+static volatile sig_atomic_t stop;
+
+void finger_hw_move(int16_t x, int16_t y) {
+	if (verbose)
+		fprintf(stderr, "move %d,%d\n", x, y);
+}
+
+void finger_hw_pick(void) {
+	if (verbose)
+		fprintf(stderr, "pick\n");
+}
+
+void finger_hw_drop(void) {
+	if (verbose)
+		fprintf(stderr, "drop\n");
+}
+
+void finger_hw_led(uint8_t on) {
+}
+
+void finger_hw_send(const uint8_t *buf, uint8_t len) {
+	if (write(out_fd, buf, len) != len)
+		perror("fingersim: write");
+}
+
+static uint32_t millis(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void on_signal(int sig) {
+	stop = 1;
+}
+
+/*
+ * Open a raw pseudo terminal and link path to its slave side. The slave
+ * stays open here too, so clients can come and go without the master
+ * seeing a hangup. Returns the master, or -1.
+ */
+static int open_pty(const char *path, int *slave) {
+	struct termios tio;
+	const char *name;
+	int master = posix_openpt(O_RDWR | O_NOCTTY);
+
+	if (master < 0 || grantpt(master) || unlockpt(master) || !(name = ptsname(master)))
+		return -1;
+	*slave = open(name, O_RDWR | O_NOCTTY);
+	if (*slave < 0 || tcgetattr(*slave, &tio))
+		return -1;
+	cfmakeraw(&tio);
+	if (tcsetattr(*slave, TCSANOW, &tio))
+		return -1;
+
+	unlink(path);
+	if (symlink(name, path))
+		return -1;
+	if (verbose)
+		fprintf(stderr, "%s -> %s\n", path, name);
+	return master;
+}
+
+int main(int argc, char *argv[]) {
+	struct finger_fw fw;
+	struct pollfd pfd;
+	struct sigaction sa;
+	uint8_t buf[FINGER_FW_RX];
+	const char *link = NULL;
+	int slave = -1;
+	ssize_t n, i;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "vp:")) != -1) {
+		switch (opt) {
+		case 'v':
+			verbose = 1;
+			break;
+		case 'p':
+			link = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-v] [-p path]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (link) {
+		in_fd = open_pty(link, &slave);
+		if (in_fd < 0) {
+			perror("fingersim: pty");
+			return 1;
+		}
+		out_fd = in_fd;
+	}
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	pfd.fd = in_fd;
+	pfd.events = POLLIN;
+	finger_fw_init(&fw);
+	while (!stop) {
+		// like loop(): take what fits in the ring, then let the firmware poll
+		pfd.revents = 0;
+		if (fw.rx_head == fw.rx_tail && poll(&pfd, 1, FINGER_FW_LED_MS) < 0)
+			continue;
+		if (pfd.revents & (POLLIN | POLLHUP)) {
+			n = read(in_fd, buf, FINGER_FW_RX - (uint8_t)(fw.rx_head - fw.rx_tail));
+			if (n <= 0 && fw.rx_head == fw.rx_tail)
+				break;
+			for (i = 0; i < n; i++)
+				finger_fw_push(&fw, buf[i]);
+		}
+		finger_fw_poll(&fw, millis());
+	}
+
+	if (link) {
+		unlink(link);
+		close(slave);
+		close(in_fd);
+	}
+	if (verbose)
+		fprintf(stderr, "%u commands\n", fw.commands);
+	return 0;
+}
@@ -0,0 +1,95 @@
+/*
+ * Query or change the buffer sizes, URB depth and timeouts of a device.
+ *
+ *   ardutune /dev/ardu0
+ *   ardutune /dev/ardu0 rx_ring_size=65536 tx_urbs=32 read_timeout_ms=500
+ *
+ * Prints the configuration in effect afterwards, one name=value per line.
+ */
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include <arduino_ioctl.h>
+
+struct field
+{
+    const char *name;
+    size_t offset;
+    unsigned int mask;
+};
+
+static const struct field fields[] = {
+    { "rx_ring_size", offsetof(struct arduino_tuning, rx_ring_size), ARDUINO_TUNE_RX_RING_SIZE },
+    { "rx_urbs", offsetof(struct arduino_tuning, rx_urbs), ARDUINO_TUNE_RX_URBS },
+    { "rx_urb_size", offsetof(struct arduino_tuning, rx_urb_size), ARDUINO_TUNE_RX_URB_SIZE },
+    { "tx_urbs", offsetof(struct arduino_tuning, tx_urbs), ARDUINO_TUNE_TX_URBS },
+    { "read_timeout_ms", offsetof(struct arduino_tuning, read_timeout_ms), ARDUINO_TUNE_READ_TIMEOUT },
+    { "coalesce_us", offsetof(struct arduino_tuning, coalesce_us), ARDUINO_TUNE_COALESCE },
+};
+
+#define NFIELDS (sizeof(fields) / sizeof(fields[0]))
+
+static __u32 *field_of(struct arduino_tuning *t, const struct field *f)
+{
+    return (__u32 *)((char *)t + f->offset);
+}
+
+static int usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s device [name=value]...\nnames:", prog);
+    for (size_t i = 0; i < NFIELDS; i++)
+        fprintf(stderr, " %s", fields[i].name);
+    fprintf(stderr, "\n");
+    return 2;
+}
+
+int main(int argc, char **argv)
+{
+    struct arduino_tuning t;
+    char *value, *end;
+    size_t i;
+    int fd;
+
+    if (argc < 2)
+        return usage(argv[0]);
+
+    memset(&t, 0, sizeof(t));
+    for (int arg = 2; arg < argc; arg++)
+    {
+        value = strchr(argv[arg], '=');
+        if (!value)
+            return usage(argv[0]);
+        *value++ = '\0';
+        for (i = 0; i < NFIELDS && strcmp(argv[arg], fields[i].name); i++)
+            ;
+        if (i == NFIELDS)
+            return usage(argv[0]);
+        *field_of(&t, &fields[i]) = strtoul(value, &end, 0);
+        if (*value == '\0' || *end != '\0')
+            return usage(argv[0]);
+        t.mask |= fields[i].mask;
+    }
+
+    fd = open(argv[1], O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+    if (ioctl(fd, t.mask ? ARDUINO_IOC_SET_TUNING : ARDUINO_IOC_GET_TUNING, &t) < 0)
+    {
+        perror(t.mask ? "ARDUINO_IOC_SET_TUNING" : "ARDUINO_IOC_GET_TUNING");
+        close(fd);
+        return 1;
+    }
+    close(fd);
+
+    for (i = 0; i < NFIELDS; i++)
+        printf("%s=%u\n", fields[i].name, *field_of(&t, &fields[i]));
+    return 0;
+}
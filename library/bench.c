@@ -0,0 +1,311 @@
+/*
+ * Throughput and latency of the library and driver against a board, or
+ * against fingersim from firmware/sim as a loopback stand-in. Every run
+ * prints one JSON object per line:
+ *
+ *   rtt         one command in flight, round trip until its ack
+ *   throughput  threads x handles writing batches, until every ack is back
+ *   async       the asynchronous queue, submit to ack latency under load
+ *
+ * Usage: bench [device=/dev/ttyardu0] [commands=10000]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include <finger.h>
+
+#define BENCH_TIMEOUT 10.0        //seconds a run may take before it is given up
+
+static const char *device;
+static long commands;
+
+struct kind
+{
+    const char *name;
+    struct finger_cmd cmd;
+};
+
+static const struct kind kinds[] = {
+    { "pick", { FINGER_PICK, 0, 0 } },
+    { "move", { FINGER_MOVE, 12, 34 } },
+    { "move_wide", { FINGER_MOVE, -30000, -30000 } },
+};
+
+static const char *protos[] = { "ascii", "binary" };
+static const size_t batches[] = { 1, 16, 256 };
+static const int concurrency[] = { 1, 2, 4 };
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+//Sorts samples, returns the p-th percentile in microseconds
+static double percentile(double *samples, long n, double p)
+{
+    long i = (long)(p * n);
+
+    if (!n)
+        return 0;
+    if (i >= n)
+        i = n - 1;
+    return samples[i] * 1e6;
+}
+
+static void report(const char *test, int proto, const struct kind *k, size_t msg_bytes,
+                   size_t batch, int threads, long count, long acked, double seconds,
+                   double *samples, long nsamples)
+{
+    printf("{\"test\":\"%s\",\"device\":\"%s\",\"proto\":\"%s\",\"cmd\":\"%s\","
+           "\"msg_bytes\":%zu,\"batch\":%zu,\"threads\":%d,\"commands\":%ld,\"acked\":%ld,"
+           "\"seconds\":%.6f,\"cmds_per_s\":%.1f,\"bytes_per_s\":%.1f",
+           test, device, protos[proto], k->name, msg_bytes, batch, threads, count, acked,
+           seconds, acked / seconds, acked * msg_bytes / seconds);
+    if (samples)
+    {
+        qsort(samples, nsamples, sizeof(double), cmp_double);
+        printf(",\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f",
+               percentile(samples, nsamples, 0.5), percentile(samples, nsamples, 0.99),
+               percentile(samples, nsamples, 0.999));
+    }
+    printf("}\n");
+    fflush(stdout);
+}
+
+//Reads from fd until count more acks arrived or the deadline passed, returns how many did
+static long wait_acks(int fd, struct finger_parser *parser, long count, double deadline)
+{
+    uint8_t buf[256];
+    struct finger_msg msg;
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    long acked = 0;
+    ssize_t n;
+
+    while (acked < count)
+    {
+        int left = (int)((deadline - now()) * 1000);
+        if (left <= 0 || poll(&pfd, 1, left) <= 0)
+            break;
+        n = read(fd, buf, sizeof(buf));
+        if (n <= 0)
+            break;
+        for (ssize_t i = 0; i < n; i++)
+            if (finger_parse(parser, buf[i]) && finger_decode(parser, &msg) && msg.op == FINGER_OP_ACK)
+                acked++;
+    }
+    return acked;
+}
+
+static size_t msg_bytes(int proto, const struct kind *k)
+{
+    char buf[FINGER_CMD_MAX];
+
+    return proto == FINGER_PROTO_BINARY ? finger_encode_frame(buf, &k->cmd) : finger_encode(buf, &k->cmd);
+}
+
+static int bench_rtt(int proto, const struct kind *k)
+{
+    struct finger_parser parser = { 0 };
+    struct finger *f = finger_open(device);
+    long samples = commands / 10 > 100 ? commands / 10 : 100, acked = 0;
+    double *rtt, start, t;
+
+    if (!f)
+        return -1;
+    rtt = (double *)calloc(samples, sizeof(double));
+    if (!rtt)
+    {
+        finger_close(f);
+        return -1;
+    }
+    finger_set_proto(f, (enum finger_proto)proto);
+
+    start = now();
+    for (; acked < samples; acked++)
+    {
+        t = now();
+        if (finger_submit_batch(f, &k->cmd, 1) < 0 || wait_acks(finger_fd(f), &parser, 1, start + BENCH_TIMEOUT) < 1)
+            break;
+        rtt[acked] = now() - t;
+    }
+    report("rtt", proto, k, msg_bytes(proto, k), 1, 1, samples, acked, now() - start, rtt, acked);
+
+    free(rtt);
+    finger_close(f);
+    return 0;
+}
+
+struct writer
+{
+    pthread_t thread;
+    struct finger *f;
+    const struct finger_cmd *cmds;
+    size_t batch;
+    long sent;                    //commands written before the thread stopped
+};
+
+static void *writer_thread(void *data)
+{
+    struct writer *w = (struct writer *)data;
+    long batch = (long)w->batch;
+
+    while (w->sent < commands)
+    {
+        long n = commands - w->sent < batch ? commands - w->sent : batch;
+        if (finger_submit_batch(w->f, w->cmds, (size_t)n) < 0)
+        {
+            perror("bench: write");
+            break;
+        }
+        w->sent += n;
+    }
+    return NULL;
+}
+
+//Every thread writes through its own handle, acks are collected on one more
+static int bench_throughput(int proto, const struct kind *k, size_t batch, int threads)
+{
+    struct finger_parser parser = { 0 };
+    struct writer w[threads];
+    struct finger_cmd *cmds = (struct finger_cmd *)malloc(batch * sizeof(struct finger_cmd));
+    struct finger *drain = finger_open(device);
+    double start, seconds;
+    long acked, sent = 0;
+    int i, started = 0;
+
+    if (!drain || !cmds)
+        return -1;
+    for (size_t j = 0; j < batch; j++)
+        cmds[j] = k->cmd;
+
+    start = now();
+    for (i = 0; i < threads; i++)
+    {
+        w[i].f = finger_open(device);
+        if (!w[i].f)
+            break;
+        finger_set_proto(w[i].f, (enum finger_proto)proto);
+        w[i].cmds = cmds;
+        w[i].batch = batch;
+        w[i].sent = 0;
+        if (pthread_create(&w[i].thread, NULL, writer_thread, &w[i]))
+        {
+            finger_close(w[i].f);
+            break;
+        }
+        started++;
+    }
+    acked = wait_acks(finger_fd(drain), &parser, started * commands, start + BENCH_TIMEOUT);
+    seconds = now() - start;
+
+    //Only what the writers got out counts, a thread may have failed to start or stopped early
+    for (i = 0; i < started; i++)
+    {
+        pthread_join(w[i].thread, NULL);
+        finger_close(w[i].f);
+        sent += w[i].sent;
+    }
+    report("throughput", proto, k, msg_bytes(proto, k), batch, started, sent,
+           acked, seconds, NULL, 0);
+    finger_close(drain);
+    free(cmds);
+    return started == threads ? 0 : -1;
+}
+
+struct async_sample
+{
+    double submitted;
+    double *latency;
+    atomic_long *done;
+};
+
+static void async_done(void *arg, int status)
+{
+    struct async_sample *s = (struct async_sample *)arg;
+
+    if (status)
+        return;
+    *s->latency = now() - s->submitted;
+    atomic_fetch_add(s->done, 1);
+}
+
+static int bench_async(int proto, const struct kind *k)
+{
+    struct finger *f = finger_open(device);
+    struct finger_async *a;
+    struct async_sample *s = (struct async_sample *)calloc(commands, sizeof(struct async_sample));
+    double *latency = (double *)calloc(commands, sizeof(double));
+    atomic_long done = 0;
+    double start;
+    long i;
+
+    if (!f || !s || !latency)
+        return -1;
+    finger_set_proto(f, (enum finger_proto)proto);
+    a = finger_async_start(f);
+    if (!a)
+        return -1;
+
+    start = now();
+    for (i = 0; i < commands && now() < start + BENCH_TIMEOUT; )
+    {
+        s[i].latency = &latency[i];
+        s[i].done = &done;
+        s[i].submitted = now();
+        if (finger_async_submit(a, &k->cmd, async_done, &s[i]) == 0)
+            i++;
+        else
+            sched_yield();
+    }
+    while (atomic_load(&done) < i && now() < start + BENCH_TIMEOUT)
+        usleep(100);
+    finger_async_stop(a);
+
+    //Canceled commands left zeroes behind, only the completed ones count
+    for (long j = 0, n = 0; j < i; j++)
+        if (latency[j] > 0)
+            latency[n++] = latency[j];
+    report("async", proto, k, msg_bytes(proto, k), 1, 1, commands, atomic_load(&done),
+           now() - start, latency, atomic_load(&done));
+
+    free(latency);
+    free(s);
+    finger_close(f);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    device = argc > 1 ? argv[1] : "/dev/ttyardu0";
+    commands = argc > 2 ? atol(argv[2]) : 10000;
+
+    for (int proto = 0; proto < 2; proto++)
+        for (size_t k = 0; k < sizeof(kinds) / sizeof(kinds[0]); k++)
+        {
+            if (bench_rtt(proto, &kinds[k]) < 0 || bench_async(proto, &kinds[k]) < 0)
+                goto error;
+            for (size_t b = 0; b < sizeof(batches) / sizeof(batches[0]); b++)
+                for (size_t t = 0; t < sizeof(concurrency) / sizeof(concurrency[0]); t++)
+                    if (bench_throughput(proto, &kinds[k], batches[b], concurrency[t]) < 0)
+                        goto error;
+        }
+    return 0;
+
+error:
+    fprintf(stderr, "bench: can't use %s\n", device);
+    return 1;
+}
@@ -0,0 +1,452 @@
+/*
+ * libfinger, see finger.h for the interface. Built with
+ * -fvisibility=hidden, only what finger.h marks FINGER_API is exported.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+
+//Only exposed by glibc with _XOPEN_SOURCE, Linux accepts 1024 segments
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+#include <errno.h>
+
+#include <finger.h>
+
+/* An open device, every command goes through its file descriptor */
+struct finger {
+	int fd;
+	enum finger_proto proto;
+	pthread_mutex_t lock;	//one writer at a time, guards everything below
+	char *batch;		//encoded commands of finger_submit_batch()
+	size_t batch_cap;
+	struct iovec *iov;	//batch split into driver sized writes
+	size_t iov_cap;
+};
+
+struct finger *finger_open(const char *device)  {
+	struct finger *f = (struct finger *)calloc(1, sizeof(struct finger));
+	if (!f)
+		return NULL;
+
+	f->fd = open(device, O_RDWR | O_CLOEXEC);
+	if (f->fd < 0)	{
+		free(f);
+		return NULL;
+	}
+	pthread_mutex_init(&f->lock, NULL);
+	return f;
+}
+
+void finger_close(struct finger *f)  {
+	if (!f)
+		return;
+	close(f->fd);
+	pthread_mutex_destroy(&f->lock);
+	free(f->batch);
+	free(f->iov);
+	free(f);
+}
+
+void finger_set_proto(struct finger *f, enum finger_proto proto)  {
+	f->proto = proto;
+}
+
+int finger_fd(const struct finger *f)  {
+	return f->fd;
+}
+
+//Encode cmd in the wire format of the handle
+static inline size_t finger_encode_cmd(const struct finger *f, char *buf, const struct finger_cmd *cmd)  {
+	if (f->proto == FINGER_PROTO_BINARY)
+		return finger_encode_frame(buf, cmd);
+	return finger_encode(buf, cmd);
+}
+
+static ssize_t finger_write_locked(struct finger *f, const void *buf, size_t size)  {
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < size)	{
+		n = write(f->fd, (const char *)buf + done, size - done);
+		if (n < 0)	{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		done += n;
+	}
+	return done;
+}
+
+//Holding the lock over the whole loop keeps other threads' commands out of a partial write
+ssize_t finger_write(struct finger *f, const void *buf, size_t size)  {
+	ssize_t n;
+
+	pthread_mutex_lock(&f->lock);
+	n = finger_write_locked(f, buf, size);
+	pthread_mutex_unlock(&f->lock);
+	return n;
+}
+
+//Bytes per iovec of a batch, each one becomes a single driver write() and bulk URB
+#define FINGER_BATCH_SEGMENT 512
+
+int finger_submit_batch(struct finger *f, const struct finger_cmd *cmds, size_t count)  {
+	size_t len = 0, seg_start = 0, cmd_len, done, i;
+	size_t nseg = 0;
+	ssize_t n;
+	int ret = -1;
+	void *p;
+
+	pthread_mutex_lock(&f->lock);
+	if (f->batch_cap < count * FINGER_CMD_MAX)	{
+		p = realloc(f->batch, count * FINGER_CMD_MAX);
+		if (!p)
+			goto out;
+		f->batch = (char *)p;
+		f->batch_cap = count * FINGER_CMD_MAX;
+	}
+	if (f->iov_cap < count + 1)	{
+		p = realloc(f->iov, (count + 1) * sizeof(struct iovec));
+		if (!p)
+			goto out;
+		f->iov = (struct iovec *)p;
+		f->iov_cap = count + 1;
+	}
+
+	//Segments end on command boundaries so no command is split across URBs
+	for (i = 0; i < count; i++)	{
+		cmd_len = finger_encode_cmd(f, f->batch + len, &cmds[i]);
+		if (len + cmd_len - seg_start > FINGER_BATCH_SEGMENT)	{
+			f->iov[nseg].iov_base = f->batch + seg_start;
+			f->iov[nseg++].iov_len = len - seg_start;
+			seg_start = len;
+		}
+		len += cmd_len;
+	}
+	if (len > seg_start)	{
+		f->iov[nseg].iov_base = f->batch + seg_start;
+		f->iov[nseg++].iov_len = len - seg_start;
+	}
+
+	for (i = 0; i < nseg; )	{
+		n = writev(f->fd, f->iov + i, nseg - i < IOV_MAX ? nseg - i : IOV_MAX);
+		if (n < 0)	{
+			if (errno == EINTR)
+				continue;
+			goto out;
+		}
+		//Skip what was written, the driver may stop short inside a segment
+		for (done = n; i < nseg && done >= f->iov[i].iov_len; i++)
+			done -= f->iov[i].iov_len;
+		if (done)	{
+			f->iov[i].iov_base = (char *)f->iov[i].iov_base + done;
+			f->iov[i].iov_len -= done;
+		}
+	}
+	ret = 0;
+
+out:
+	pthread_mutex_unlock(&f->lock);
+	return ret;
+}
+
+static ssize_t finger_send(struct finger *f, enum finger_op op, int x, int y)  {
+	char message[FINGER_CMD_MAX];
+	struct finger_cmd cmd = { op, x, y };
+	return finger_write(f, message, finger_encode_cmd(f, message, &cmd));
+}
+
+ssize_t finger_move(struct finger *f, int x, int y)  {
+	return finger_send(f, FINGER_MOVE, x, y);
+}
+
+ssize_t finger_pick(struct finger *f)  {
+	return finger_send(f, FINGER_PICK, 0, 0);
+}
+
+ssize_t finger_drop(struct finger *f)  {
+	return finger_send(f, FINGER_DROP, 0, 0);
+}
+
+
+struct finger_async_req {
+	struct finger_cmd cmd;
+	finger_done_fn done;
+	void *arg;
+};
+
+struct finger_async {
+	struct finger *f;
+	pthread_t thread;
+	int wake_fd;			//eventfd, kicks the I/O thread out of poll()
+	atomic_int sleeping;		//the I/O thread is (about to be) in poll()
+	atomic_int stop;
+	atomic_size_t sq_head;		//advanced by the I/O thread
+	atomic_size_t sq_tail;		//advanced by the submitter
+	struct finger_async_req sq[FINGER_ASYNC_DEPTH];
+	//Below is only touched by the I/O thread
+	struct finger_async_req pending[FINGER_ASYNC_WINDOW];
+	size_t pend_head, pend_tail;
+	struct finger_parser parser;	//acknowledgement being received
+};
+
+static void finger_async_complete(struct finger_async *a, int status)  {
+	struct finger_async_req *req = &a->pending[a->pend_head++ % FINGER_ASYNC_WINDOW];
+
+	if (req->done)
+		req->done(req->arg, status);
+}
+
+//Write queued commands while the acknowledgement window has room
+static void finger_async_flush(struct finger_async *a)  {
+	char buf[FINGER_ASYNC_WINDOW * FINGER_CMD_MAX];
+	size_t head = atomic_load_explicit(&a->sq_head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&a->sq_tail, memory_order_acquire);
+	size_t first = a->pend_tail, len = 0;
+
+	while (head != tail && a->pend_tail - a->pend_head < FINGER_ASYNC_WINDOW)	{
+		a->pending[a->pend_tail++ % FINGER_ASYNC_WINDOW] = a->sq[head % FINGER_ASYNC_DEPTH];
+		len += finger_encode_cmd(a->f, buf + len, &a->sq[head % FINGER_ASYNC_DEPTH].cmd);
+		head++;
+	}
+	atomic_store_explicit(&a->sq_head, head, memory_order_release);
+
+	if (len && finger_write(a->f, buf, len) < 0)	{
+		//Nothing of this round will be acknowledged, fail it right away
+		int status = -errno;
+		struct finger_async_req *req;
+
+		for (size_t i = first; i != a->pend_tail; i++)	{
+			req = &a->pending[i % FINGER_ASYNC_WINDOW];
+			if (req->done)
+				req->done(req->arg, status);
+		}
+		a->pend_tail = first;
+	}
+}
+
+//Parse what the board sent, each acknowledgement or rejection completes one command
+static void finger_async_receive(struct finger_async *a)  {
+	uint8_t buf[256];
+	struct finger_msg msg;
+	ssize_t n = read(a->f->fd, buf, sizeof(buf));
+
+	for (ssize_t i = 0; i < n; i++)	{
+		if (!finger_parse(&a->parser, buf[i]) || !finger_decode(&a->parser, &msg))
+			continue;
+		if ((msg.op == FINGER_OP_ACK || msg.op == FINGER_OP_ERR) && a->pend_head != a->pend_tail)
+			finger_async_complete(a, msg.op == FINGER_OP_ACK ? 0 : -EINVAL);
+	}
+}
+
+static void *finger_async_thread(void *data)  {
+	struct finger_async *a = (struct finger_async *)data;
+	struct pollfd fds[2];
+	uint64_t kick;
+
+	fds[0].fd = a->wake_fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = a->f->fd;
+	fds[1].events = POLLIN;
+
+	while (!atomic_load(&a->stop))	{
+		finger_async_flush(a);
+
+		//Announce the nap, then make sure no submission slipped in before it
+		atomic_store(&a->sleeping, 1);
+		if (atomic_load(&a->sq_tail) != atomic_load(&a->sq_head) &&
+		a->pend_tail - a->pend_head < FINGER_ASYNC_WINDOW)	{
+			atomic_store(&a->sleeping, 0);
+			continue;
+		}
+		if (poll(fds, 2, -1) < 0 && errno != EINTR)
+			break;
+		atomic_store(&a->sleeping, 0);
+
+		if ((fds[0].revents & POLLIN) && read(a->wake_fd, &kick, sizeof(kick)) < 0 && errno != EAGAIN)
+			break;
+		if (fds[1].revents & POLLIN)
+			finger_async_receive(a);
+		if (fds[1].revents & (POLLERR | POLLHUP))
+			break;
+	}
+	return NULL;
+}
+
+struct finger_async *finger_async_start(struct finger *f)  {
+	struct finger_async *a = (struct finger_async *)calloc(1, sizeof(struct finger_async));
+	if (!a)
+		return NULL;
+
+	a->f = f;
+	a->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (a->wake_fd < 0)
+		goto error;
+	if (pthread_create(&a->thread, NULL, finger_async_thread, a))	{
+		close(a->wake_fd);
+		goto error;
+	}
+	return a;
+
+error:
+	free(a);
+	return NULL;
+}
+
+int finger_async_submit(struct finger_async *a, const struct finger_cmd *cmd, finger_done_fn done, void *arg)  {
+	size_t tail = atomic_load_explicit(&a->sq_tail, memory_order_relaxed);
+	struct finger_async_req *req;
+	uint64_t kick = 1;
+
+	if (tail - atomic_load_explicit(&a->sq_head, memory_order_acquire) == FINGER_ASYNC_DEPTH)	{
+		errno = EAGAIN;
+		return -1;
+	}
+
+	req = &a->sq[tail % FINGER_ASYNC_DEPTH];
+	req->cmd = *cmd;
+	req->done = done;
+	req->arg = arg;
+	atomic_store(&a->sq_tail, tail + 1);
+
+	//Only pay for the wakeup when the I/O thread sleeps
+	if (atomic_load(&a->sleeping) && write(a->wake_fd, &kick, sizeof(kick)) < 0)
+		perror("finger_async_submit");
+	return 0;
+}
+
+void finger_async_stop(struct finger_async *a)  {
+	uint64_t kick = 1;
+	size_t head, tail;
+
+	atomic_store(&a->stop, 1);
+	if (write(a->wake_fd, &kick, sizeof(kick)) < 0)
+		perror("finger_async_stop");
+	pthread_join(a->thread, NULL);
+
+	while (a->pend_head != a->pend_tail)
+		finger_async_complete(a, -ECANCELED);
+	head = atomic_load(&a->sq_head);
+	tail = atomic_load(&a->sq_tail);
+	for (; head != tail; head++)
+		if (a->sq[head % FINGER_ASYNC_DEPTH].done)
+			a->sq[head % FINGER_ASYNC_DEPTH].done(a->sq[head % FINGER_ASYNC_DEPTH].arg, -ECANCELED);
+
+	close(a->wake_fd);
+	free(a);
+}
+
+
+//Device used by the calls below, kept open between commands
+static struct finger *_finger;
+//Read locked while a call uses _finger, write locked to replace it
+static pthread_rwlock_t _finger_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+//Set device file
+int set_device(char *device ) {
+	struct finger *f = finger_open(device);
+	if (!f)	{
+		//Returns false if failed
+		printf("Error opening device\n");
+		return 0;
+	} 
+	else  {
+		//Replace the previous device if successful
+		pthread_rwlock_wrlock(&_finger_lock);
+		finger_close(_finger);
+		_finger = f;
+		pthread_rwlock_unlock(&_finger_lock);
+		printf("Successfully opened device!\n");
+		return 1;
+	}
+}
+
+size_t write_to_device(char* string, size_t size)  {
+	ssize_t n = -1;
+
+	pthread_rwlock_rdlock(&_finger_lock);
+	if (_finger != NULL)
+		n = finger_write(_finger, string, size);
+	pthread_rwlock_unlock(&_finger_lock);
+	if (n >= 0)	{
+		return size;
+	}
+	else 	{
+		printf("I/O Error\n");
+		return -1;
+	}
+}
+
+//Runs one command on the default device, if there is one
+static void finger_default_send(enum finger_op op, int x, int y)  {
+	pthread_rwlock_rdlock(&_finger_lock);
+	if (_finger != NULL)
+		finger_send(_finger, op, x, y);
+	pthread_rwlock_unlock(&_finger_lock);
+}
+
+
+void move(int x, int y)  {
+	finger_default_send(FINGER_MOVE, x, y);
+}
+
+
+void pick(void)  {
+	finger_default_send(FINGER_PICK, 0, 0);
+}
+
+
+void drop(void)  {
+	finger_default_send(FINGER_DROP, 0, 0);
+}
+
+
+int finger_rx_map(struct finger_rx *rx, const char *device)  {
+	long page = sysconf(_SC_PAGESIZE);
+	void *map;
+
+	rx->fd = open(device, O_RDWR);
+	if (rx->fd < 0)
+		return -1;
+
+	//The control page tells how big the data part is
+	map = mmap(NULL, page, PROT_READ, MAP_SHARED, rx->fd, 0);
+	if (map == MAP_FAILED)
+		goto error;
+	rx->map_len = ((struct arduino_ring_ctrl *)map)->data_offset + ((struct arduino_ring_ctrl *)map)->size;
+	munmap(map, page);
+
+	map = mmap(NULL, rx->map_len, PROT_READ, MAP_SHARED, rx->fd, 0);
+	if (map == MAP_FAILED)
+		goto error;
+	rx->ctrl = (struct arduino_ring_ctrl *)map;
+	rx->data = (const uint8_t *)map + rx->ctrl->data_offset;
+	//Like an open file, the mapping sees what arrives from now on
+	rx->tail = __atomic_load_n(&rx->ctrl->head, __ATOMIC_ACQUIRE);
+	rx->lost = 0;
+	return 0;
+
+error:
+	close(rx->fd);
+	rx->fd = -1;
+	return -1;
+}
+
+void finger_rx_unmap(struct finger_rx *rx)  {
+	munmap(rx->ctrl, rx->map_len);
+	close(rx->fd);
+	rx->fd = -1;
+}
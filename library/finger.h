@@ -3,65 +3,238 @@
 #define _ARDUINO_LIBRARY_H
 
 #include <stdint.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <unistd.h>
-
-FILE *_dev;   
-char *_device;
-
-//Set device file
-int set_device(char *device ) {
-	//Open device file
-	_dev = fopen(device, "r+");
-	if (!_dev)	{
-		//Returns false if failed
-		printf("Error opening device\n");
-		return 0;
-	} 
-	else  {
-		//Set device if successful
-		fclose(_dev);
-		printf("Successfully opened device!\n");
-		_device = device;
-		return 1;
-	}
+#include <stddef.h>
+#include <sys/types.h>
+
+#include <arduino_ioctl.h>
+#include <finger_proto.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//Symbols exported by libfinger, the rest of finger.c stays internal
+#define FINGER_API __attribute__((visibility("default")))
+
+//Longest encoded command, "m-2147483648,-2147483648\n" plus room to spare
+#define FINGER_CMD_MAX 32
+
+//Decimal digits of v, returns how many bytes were written to buf
+static inline size_t finger_put_int(char *buf, int v)  {
+	char digits[10];
+	size_t n = 0, len = 0;
+	unsigned int u = v < 0 ? 0u - (unsigned int)v : (unsigned int)v;
+
+	if (v < 0)
+		buf[len++] = '-';
+	do	{
+		digits[n++] = '0' + u % 10;
+		u /= 10;
+	} while (u);
+	while (n)
+		buf[len++] = digits[--n];
+	return len;
 }
 
-size_t write_to_device(char* string, size_t size)  {
-	_dev = fopen(_device, "r+");
-	if(_dev != NULL){
-		fwrite((const void *)(string), size, 1, _dev);
-		fclose(_dev);
-		return size;
-	}
-	else 	{
-		printf("I/O Error\n");
-		return -1;
-	}
+/*
+ * Command encoders: format into buf, which must hold FINGER_CMD_MAX bytes,
+ * and return the length of the command. No NUL is written.
+ */
+static inline size_t finger_encode_move(char *buf, int x, int y)  {
+	size_t len = 0;
+
+	buf[len++] = 'm';
+	len += finger_put_int(buf + len, x);
+	buf[len++] = ',';
+	len += finger_put_int(buf + len, y);
+	buf[len++] = '\n';
+	return len;
 }
 
+static inline size_t finger_encode_pick(char *buf)  {
+	buf[0] = 'p';
+	buf[1] = '\n';
+	return 2;
+}
 
-void move(int x, int y)  {
-	char *message = (char*)malloc(8 * sizeof(char));
-	sprintf(message, "m%d,%d\n",x,y);
-	write_to_device(message,8);
+static inline size_t finger_encode_drop(char *buf)  {
+	buf[0] = 'd';
+	buf[1] = '\n';
+	return 2;
 }
 
+enum finger_op {
+	FINGER_MOVE,
+	FINGER_PICK,
+	FINGER_DROP,
+};
+
+//One command of a batch, x and y are only used by FINGER_MOVE
+struct finger_cmd {
+	enum finger_op op;
+	int x;
+	int y;
+};
 
-void pick()  {
-	char *message = (char*)malloc(2 * sizeof(char));
-	sprintf(message, "p\n");
-	write_to_device(message,2);
+static inline size_t finger_encode(char *buf, const struct finger_cmd *cmd)  {
+	switch (cmd->op)	{
+	case FINGER_MOVE:
+		return finger_encode_move(buf, cmd->x, cmd->y);
+	case FINGER_PICK:
+		return finger_encode_pick(buf);
+	case FINGER_DROP:
+		return finger_encode_drop(buf);
+	}
+	return 0;
 }
 
+//Binary frame of a command, see finger_proto.h. Coordinates are clamped to int16.
+static inline size_t finger_encode_frame(char *buf, const struct finger_cmd *cmd)  {
+	uint8_t operands[4];
+	int x = cmd->x < INT16_MIN ? INT16_MIN : cmd->x > INT16_MAX ? INT16_MAX : cmd->x;
+	int y = cmd->y < INT16_MIN ? INT16_MIN : cmd->y > INT16_MAX ? INT16_MAX : cmd->y;
 
-void drop()  {
-	char *message = (char*)malloc(2 * sizeof(char));
-	sprintf(message, "d\n");
-	write_to_device(message,2);
+	switch (cmd->op)	{
+	case FINGER_MOVE:
+		finger_put_le16(operands, x);
+		finger_put_le16(operands + 2, y);
+		return finger_frame((uint8_t *)buf, FINGER_OP_MOVE, operands, 4);
+	case FINGER_PICK:
+		return finger_frame((uint8_t *)buf, FINGER_OP_PICK, NULL, 0);
+	case FINGER_DROP:
+		return finger_frame((uint8_t *)buf, FINGER_OP_DROP, NULL, 0);
+	}
+	return 0;
 }
 
+//Wire format of a handle, ASCII lines unless switched with finger_set_proto()
+enum finger_proto {
+	FINGER_PROTO_ASCII,
+	FINGER_PROTO_BINARY,
+};
+
+
+/*
+ * An open device, every command goes through its file descriptor.
+ * Handles are independent, so threads driving different boards never
+ * contend. Threads may also share one handle: each call writes its
+ * commands whole, never interleaved with another thread's.
+ */
+struct finger;
+
+//Open a device, the descriptor stays open until finger_close()
+FINGER_API struct finger *finger_open(const char *device);
+FINGER_API void finger_close(struct finger *f);
+//Pick the protocol before the handle is shared or runs an async queue
+FINGER_API void finger_set_proto(struct finger *f, enum finger_proto proto);
+//Descriptor of a handle, to poll() for what the board sends back
+FINGER_API int finger_fd(const struct finger *f);
+
+//Write the whole buffer, the driver may accept less than asked per call
+FINGER_API ssize_t finger_write(struct finger *f, const void *buf, size_t size);
+
+/*
+ * Encode a whole array of commands into one buffer and hand it to the
+ * driver in as few calls as possible, one writev of up to IOV_MAX
+ * segments. Returns 0, or -1 with errno set.
+ */
+FINGER_API int finger_submit_batch(struct finger *f, const struct finger_cmd *cmds, size_t count);
+
+FINGER_API ssize_t finger_move(struct finger *f, int x, int y);
+FINGER_API ssize_t finger_pick(struct finger *f);
+FINGER_API ssize_t finger_drop(struct finger *f);
+
+
+/*
+ * Asynchronous mode: commands are queued from one submitting thread into
+ * a lock-free single producer/single consumer ring, and a background I/O
+ * thread writes them out and reads the firmware's FINGER_OP_ACK messages
+ * back. Each acknowledgement completes the oldest command, whose callback
+ * then runs on the I/O thread with status 0, -EINVAL if the firmware
+ * answered FINGER_OP_ERR, a negative errno if it could not be written,
+ * or -ECANCELED when the queue is stopped first.
+ * Don't use the synchronous calls on a handle that runs a queue.
+ */
+typedef void (*finger_done_fn)(void *arg, int status);
+
+#define FINGER_ASYNC_DEPTH 1024		//queued commands, a power of two
+#define FINGER_ASYNC_WINDOW 16		//commands written but not acknowledged yet
+
+struct finger_async;
+
+//Start the I/O thread of a handle, returns NULL on failure
+FINGER_API struct finger_async *finger_async_start(struct finger *f);
+
+/*
+ * Queue a command, never blocks. Only one thread may submit to a queue.
+ * Returns 0, or -1 with errno EAGAIN when the queue is full.
+ */
+FINGER_API int finger_async_submit(struct finger_async *a, const struct finger_cmd *cmd, finger_done_fn done, void *arg);
+
+//Stop the I/O thread, commands not acknowledged yet complete with -ECANCELED
+FINGER_API void finger_async_stop(struct finger_async *a);
+
+
+//Calls on one default device, opened with set_device(), safe from any thread
+FINGER_API int set_device(char *device);
+FINGER_API size_t write_to_device(char *string, size_t size);
+FINGER_API void move(int x, int y);
+FINGER_API void pick(void);
+FINGER_API void drop(void);
+
+
+/*
+ * Receive ring of the driver, mapped into this process. The mapping reads
+ * the whole stream with a cursor of its own, next to any open file.
+ */
+struct finger_rx {
+	int fd;
+	struct arduino_ring_ctrl *ctrl;
+	const uint8_t *data;
+	size_t map_len;
+	uint64_t tail;		//next byte of the stream to read
+	uint64_t lost;		//bytes the driver overwrote before they were read
+};
+
+//Map the receive ring of a device, returns 0 on success
+FINGER_API int finger_rx_map(struct finger_rx *rx, const char *device);
+FINGER_API void finger_rx_unmap(struct finger_rx *rx);
+
+//Points *data at the oldest unread bytes, returns how many are contiguous there
+static inline size_t finger_rx_peek(struct finger_rx *rx, const uint8_t **data)  {
+	uint64_t head = __atomic_load_n(&rx->ctrl->head, __ATOMIC_ACQUIRE);
+	uint64_t claim = __atomic_load_n(&rx->ctrl->claim, __ATOMIC_RELAXED);
+	size_t size = rx->ctrl->size;
+	size_t offset, avail;
+
+	//Distances are taken as unsigned long, 32-bit kernels count modulo 2^32
+	if ((unsigned long)(claim - rx->tail) > size)	{
+		//Fell behind, skip what was overwritten
+		rx->lost += (unsigned long)(claim - size - rx->tail);
+		rx->tail = claim - size;
+	}
+	offset = rx->tail & (size - 1);
+	avail = (unsigned long)(head - rx->tail);
+
+	*data = rx->data + offset;
+	return avail < size - offset ? avail : size - offset;
+}
+
+/*
+ * Done with size bytes returned by finger_rx_peek(). Returns 0, or -1 if
+ * the driver overwrote them meanwhile: drop what was read from them and
+ * peek again.
+ */
+static inline int finger_rx_consume(struct finger_rx *rx, size_t size)  {
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if ((unsigned long)(__atomic_load_n(&rx->ctrl->claim, __ATOMIC_RELAXED) - rx->tail) > rx->ctrl->size)
+		return -1;
+	rx->tail += size;
+	return 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
 
-#endif
\ No newline at end of file
+#endif
@@ -1,15 +1,64 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
 #include <finger.h>
 
-int main(void)
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* What write_to_device() used to do: open and close the device for every command */
+static int write_reopen(const char *device, const char *message, size_t size)
 {
-    set_device("/dev/ttyardu0");
+    FILE *dev = fopen(device, "r+");
+    if (!dev)
+        return -1;
+    fwrite(message, size, 1, dev);
+    fclose(dev);
+    return 0;
+}
 
+int main(int argc, char **argv)
+{
+    const char *device = argc > 1 ? argv[1] : "/dev/ttyardu0";
+    long commands = argc > 2 ? atol(argv[2]) : 1000;
     char message [] = "a\n";
-    for (size_t i = 0; i < 10; i++)
+    size_t size = strlen(message) * sizeof(char);
+    struct finger *f;
+    double start, reopen, handle;
+
+    start = now();
+    for (long i = 0; i < commands; i++)
     {
-       write_to_device(message, strlen(message)* sizeof(char));
+        if (write_reopen(device, message, size) < 0)
+        {
+            printf("Error opening device\n");
+            return 1;
+        }
     }
-    
-    
+    reopen = now() - start;
+
+    f = finger_open(device);
+    if (!f)
+    {
+        printf("Error opening device\n");
+        return 1;
+    }
+    start = now();
+    for (long i = 0; i < commands; i++)
+    {
+        finger_write(f, message, size);
+    }
+    handle = now() - start;
+    finger_close(f);
+
+    printf("%ld commands to %s\n", commands, device);
+    printf("open per command: %10.0f commands/s\n", commands / reopen);
+    printf("persistent handle: %9.0f commands/s\n", commands / handle);
     return 0;
-}
\ No newline at end of file
+}